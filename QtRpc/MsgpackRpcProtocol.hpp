@@ -1,75 +1,330 @@
 #pragma once
+#include <algorithm>
 #include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <memory>
+#include <optional>
 #include <stdexcept>
 #include <string>
+#include <string_view>
+#include <tuple>
+#include <utility>
+#include <vector>
 #include <msgpack.hpp>
 
 
+/**
+ * Message layout independent of the stream and handler types.
+ */
+struct MsgpackRpcMessage
+{
+    enum class MessageType {Request = 1, Response = 2, Error = 3, Event = 4, Subscribe = 5, Unsubscribe = 6,
+                            EventBatch = 7, Hello = 8, DefineName = 9,
+                            Batch = 10, Cancel = 11, StreamItems = 12, StreamCredit = 13,
+                            BlobBegin = 14, BlobChunk = 15, BlobEnd = 16, Compressed = 17};
+
+    /**
+     * Options of a request, sent as optional map after the request id.
+     */
+    struct RequestOptions
+    {
+        std::int64_t timeout = -1;  // time budget in ms, relative to avoid depending on synchronized clocks
+        std::int64_t stream = -1;   // number of stream items the client accepts before granting more
+
+        bool isEmpty() const { return timeout < 0 && stream < 0; }
+    };
+
+    /**
+     * Pack an event message into any msgpack stream, e.g. for serializing it
+     * only once and sending the result to many peers.
+     */
+    template <typename Stream, typename T>
+    static void packEvent(msgpack::packer<Stream>& packer, std::string_view name, const T& v);
+
+    // Pack event message up to the event data
+    template <typename Stream>
+    static void packEventHeader(msgpack::packer<Stream>& packer, std::string_view name);
+
+    // Pack response message up to the result value
+    template <typename Stream>
+    static void packResponseHeader(msgpack::packer<Stream>& packer, std::uint64_t id);
+
+    template <typename Stream>
+    static void packError(msgpack::packer<Stream>& packer, std::uint64_t id, std::string_view errorstr);
+
+    /**
+     * Pack a batch of emissions of the same event into a single message.
+     */
+    template <typename Stream, typename Range>
+    static void packEventBatch(msgpack::packer<Stream>& packer, std::string_view name, const Range& items);
+
+    template <typename Stream>
+    static void packString(msgpack::packer<Stream>& packer, std::string_view str);
+};
+
+
 template <class IStream, class OStream, class Handler>
-class MsgpackRpcProtocol
+class MsgpackRpcProtocol : public MsgpackRpcMessage
 {
 public:
-    enum class MessageType {Request = 1, Response = 2, Error = 3, Event = 4};
-
     IStream& m_istream;
+    OStream& m_ostream;
     Handler& m_handler;
-    msgpack::packer<OStream> m_packer;
+    // Outgoing messages are serialized into a reusable frame buffer and
+    // handed to the output stream with a single write per message
+    msgpack::sbuffer m_frame;
+    msgpack::packer<msgpack::sbuffer> m_packer;
     msgpack::unpacker m_unpacker;
+    // Received data is read in chunks, the unpacker buffer holds a chunk and the partial message
+    static constexpr std::size_t s_read_chunk = 64 * 1024;
+    // Limits for received messages, exceeding them is an error in the data stream. New limits are
+    // applied once the unpacker is between messages.
+    std::size_t m_max_message_size = std::numeric_limits<std::size_t>::max();
+    msgpack::unpack_limit m_unpack_limit;
+    bool m_renew_unpacker = false;
+    // Received messages are not dispatched while paused, e.g. while the handler is overloaded.
+    // Messages already buffered are dispatched first once reading resumes.
+    bool m_paused = false;
+    // Message currently being dispatched, handlers may retain it beyond dispatch
+    std::shared_ptr<msgpack::object_handle> m_message;
+    // Features announced by the remote peer, and whether features were announced to it
+    std::vector<std::string> m_remote_features;
+    bool m_hello_sent = false;
+    // Names replaced by integers in outgoing messages once the remote peer supports interning,
+    // names defined by the remote peer up to the same limit (deque keeps names in place when growing)
+    static constexpr std::size_t s_max_interned_names = 4096;
+    bool m_intern_names = false;
+    // Bytes of name definitions in front of the message in the frame buffer, never compressed with it
+    std::size_t m_frame_prefix = 0;
+    bool m_in_batch = false;
+    std::map<std::string, std::uint64_t, std::less<>> m_local_names;
+    std::deque<std::string> m_remote_names;
+    // Compression of outgoing messages of at least m_compress_threshold bytes (0 disables it)
+    // once the remote peer announced "zlib", the codec is provided by the user of the protocol
+    using Codec = std::function<bool(const char* data, std::size_t size, std::string& out)>;
+    Codec m_compress;
+    Codec m_decompress;
+    std::size_t m_compress_threshold = 0;
+    bool m_remote_compression = false;
+    // Remote peer accepts lists of numbers as packed arrays, see msgpack::QtTypedArrayScope
+    bool m_remote_typed_arrays = false;
+    bool m_in_compressed = false;
+    std::string m_compressed;
+    msgpack::sbuffer m_compressed_header;
+    // Outgoing messages sent compressed, their size before and after compression, and
+    // messages above the threshold sent uncompressed because compression did not pay off
+    std::uint64_t m_n_compressed = 0;
+    std::uint64_t m_bytes_uncompressed = 0;
+    std::uint64_t m_bytes_compressed = 0;
+    std::uint64_t m_n_incompressible = 0;
 
     MsgpackRpcProtocol(IStream& istream, OStream& ostream, Handler& handler) :
-        m_istream(istream), m_handler(handler), m_packer(ostream) {}
+        m_istream(istream), m_ostream(ostream), m_handler(handler), m_packer(m_frame),
+        m_unpacker(&referenceData), m_message(std::make_shared<msgpack::object_handle>()) {}
 
     void readAvailableBytes();
 
+    /**
+     * Limit the size of received messages and the nesting depth and lengths
+     * of their containers. Containers are allocated before their items are
+     * received, their limits bound the memory a single message header can
+     * claim.
+     */
+    void setReceiveLimits(std::size_t maxMessageSize, const msgpack::unpack_limit& limits);
+
+    /**
+     * Release memory of receive and send buffers grown by large messages,
+     * e.g. after the peer became idle. Buffers holding a partial message are
+     * kept.
+     */
+    void shrinkBuffers();
+
+    /**
+     * Announce supported features to the remote peer. Peers not knowing the
+     * hello message ignore it, the handler is notified of received hello
+     * messages for replying with its own. Announcing "intern" allows the
+     * remote peer to replace method and event names by integers defined on
+     * first use.
+     */
+    template <typename Range>
+    void sendHello(const Range& features);
+
+    bool remoteSupports(std::string_view feature) const {
+        for (const auto& f: m_remote_features) {
+            if (f == feature) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /**
+     * Share ownership of the message currently being dispatched, keeping
+     * all objects (and the receive buffer they reference) alive.
+     */
+    std::shared_ptr<const msgpack::object_handle> retainMessage() const { return m_message; }
+    /**
+     * Minimum size of binary data referencing the receive buffer, smaller
+     * data is copied into the zone of the message.
+     */
+    static constexpr std::size_t referenceThreshold() { return s_reference_threshold; }
+
     template <typename T>
-    void sendRequest(const std::string& method, const T& v, std::uint64_t id);
+    void sendRequest(std::string_view method, const T& v, std::uint64_t id, const RequestOptions& options = {});
 
     template <typename T>
     void sendResponse(std::uint64_t id, const T& v);
 
-    void sendError(std::uint64_t id, const std::string& errorstr);
+    /**
+     * Send several requests in a single batch message. Requests is a range
+     * of (method, args, id, options) tuples.
+     */
+    template <typename Range>
+    void sendRequestBatch(const Range& requests);
+
+    /**
+     * Send messages serialized beforehand, e.g. by packResponseHeader() and
+     * packError(), in a single batch message.
+     */
+    template <typename Range>
+    void sendBatch(const Range& messages);
+
+    /**
+     * Start a response message and return the packer for writing the result
+     * value in place. The message is sent by calling endMessage().
+     */
+    msgpack::packer<msgpack::sbuffer>& beginResponse(std::uint64_t id);
+    void endMessage();
+
+    void sendError(std::uint64_t id, std::string_view errorstr);
+
+    void sendCancel(std::uint64_t id);
+
+    /**
+     * Send items of a streamed response. The stream ends with a regular
+     * response or error message.
+     */
+    template <typename Range>
+    void sendStreamItems(std::uint64_t id, const Range& items);
+
+    // Allow the remote peer to send n more items of a streamed response
+    void sendStreamCredit(std::uint64_t id, std::uint64_t n);
+
+    /**
+     * Send a blob in chunks. Chunk data is written to the output stream
+     * directly, without copying it to the frame buffer.
+     */
+    void sendBlobBegin(std::uint64_t id, std::string_view name, std::uint64_t size);
+    void sendBlobChunk(std::uint64_t id, const char* data, std::size_t size);
+    void sendBlobEnd(std::uint64_t id, std::string_view error = {});
 
     template <typename T>
-    void sendEvent(const std::string& name, const T& v);
+    void sendEvent(std::string_view name, const T& v);
+
+    // Send message serialized beforehand, e.g. by packEvent()
+    void sendFrame(const char* data, std::size_t size);
+
+    // Send event with data serialized beforehand
+    void sendEventPayload(std::string_view name, const char* payload, std::size_t size);
+
+    // Messages of size bytes are compressed, if compression makes them smaller
+    bool compresses(std::size_t size) const {
+        return m_compress_threshold != 0 && size >= m_compress_threshold && m_remote_compression && m_compress;
+    }
+
+    /**
+     * Compress a message into the header and data of a compressed message,
+     * e.g. once for sending it to many peers. Returns false if compression
+     * does not make the message smaller.
+     */
+    bool compressMessage(const char* data, std::size_t size, msgpack::sbuffer& header, std::string& compressed) const;
+
+    // Send message compressed by compressMessage(), or the original message if compression did not pay off
+    void sendCompressed(std::size_t size, const msgpack::sbuffer& header, const std::string& compressed);
+    void sendIncompressible(const char* data, std::size_t size);
+
+    template <typename Range>
+    void sendSubscription(bool subscribe, const Range& patterns);
+
+private:
+    // Large binary data references the receive buffer instead of being copied, small data and strings
+    // are copied so retained messages don't keep the buffer alive for a few bytes
+    static constexpr std::size_t s_reference_threshold = 1024;
+    static bool referenceData(msgpack::type::object_type type, std::size_t size, void*) {
+        return type == msgpack::type::BIN && size >= s_reference_threshold;
+    }
+    bool renewUnpacker();
+    void unpackMessages();
+    bool dispatch(const msgpack::object& message);
+    bool dispatchCompressed(const msgpack::object& data);
+    void writeFrame();
+    void writeMessage(const char* data, std::size_t size);
+    std::optional<std::uint64_t> internName(std::string_view name);
+    void packName(std::string_view name, std::optional<std::uint64_t> id);
+    bool nameView(const msgpack::object& o, std::string_view& name) const;
+    void packOptions(const RequestOptions& options);
+    static bool parseOptions(const msgpack::object& o, RequestOptions& options);
+
+    static bool isId(const msgpack::object& o) { return o.type == msgpack::type::POSITIVE_INTEGER; }
+    static bool isString(const msgpack::object& o) {
+        return o.type == msgpack::type::STR || o.type == msgpack::type::BIN;
+    }
+    static std::string_view stringView(const msgpack::object& o) {
+        return (o.type == msgpack::type::STR) ? std::string_view(o.via.str.ptr, o.via.str.size)
+                                              : std::string_view(o.via.bin.ptr, o.via.bin.size);
+    }
 };
 
 
 template <class IStream, class OStream, class Handler>
 inline void MsgpackRpcProtocol<IStream, OStream, Handler>::readAvailableBytes() {
-    // read available bytes from stream to unpacker
+    if (m_paused) {
+        return;
+    }
+    // messages left in the buffer when pausing are dispatched before reading more
+    unpackMessages();
+    // read available bytes from stream to unpacker in chunks, unpacking messages after each chunk
     auto n_avail = m_istream.bytesAvailable();
-    m_unpacker.reserve_buffer(n_avail);
-    auto n_read = m_istream.read(m_unpacker.buffer(), n_avail);
-    m_unpacker.buffer_consumed(n_read);
+    while (n_avail > 0 && !m_paused) {
+        if (m_renew_unpacker) {
+            renewUnpacker();
+        }
+        const auto n_chunk = std::min(n_avail, static_cast<decltype(n_avail)>(s_read_chunk));
+        m_unpacker.reserve_buffer(static_cast<std::size_t>(n_chunk));
+        const auto n_read = m_istream.read(m_unpacker.buffer(), n_chunk);
+        if (n_read <= 0) {
+            break;
+        }
+        m_unpacker.buffer_consumed(static_cast<std::size_t>(n_read));
+        unpackMessages();
+        n_avail = m_istream.bytesAvailable();
+    }
+}
+
 
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::unpackMessages() {
     // deserialize msgpack objects from stream
-    msgpack::unpacked unpacked;
     try {
-        while (m_unpacker.next(unpacked)) {
-            // message is array of objects
-            std::vector<msgpack::object> message;
-            unpacked.get().convert(message);
-            // determine message type and call the corresponding handler
-            const auto type = static_cast<MessageType>(message.at(0).as<std::uint8_t>());
-            switch (type) {
-            case MessageType::Request:
-                // request: (type=request, method, args, id)
-                m_handler.handleRequest(message.at(1).as<std::string>(), message.at(2), message.at(3).as<std::uint64_t>());
-                break;
-            case MessageType::Response:
-                // response: (type=response, id, result)
-                m_handler.handleResponse(message.at(1).as<std::uint64_t>(), message.at(2));
-                break;
-            case MessageType::Error:
-                // error: (type=error, id, error)
-                m_handler.handleError(message.at(1).as<std::uint64_t>(), message.at(2).as<std::string>());
-                break;
-            case MessageType::Event:
-                // event: (type=event, name, args)
-                m_handler.handleEvent(message.at(1).as<std::string>(), message.at(2));
-                break;
-            default:
-                break;
+        while (!m_paused && m_unpacker.execute()) {
+            m_message->set(m_unpacker.data());
+            const bool ok = dispatch(m_message->get());
+            // the zone of the unpacker is reused for the next message unless a handler retained
+            // the message, which then takes over the zone and its references to the buffer
+            if (m_message.use_count() > 1) {
+                m_message->zone().reset(m_unpacker.release_zone());
+                m_message = std::make_shared<msgpack::object_handle>();
+            } else {
+                m_message->set(msgpack::object());
+                m_unpacker.reset_zone();
+            }
+            m_unpacker.reset();
+            if (!ok) {
+                throw std::runtime_error("error in data stream");
             }
         }
     } catch (msgpack::unpack_error&) {
@@ -77,44 +332,657 @@ inline void MsgpackRpcProtocol<IStream, OStream, Handler>::readAvailableBytes()
     } catch (msgpack::type_error&) {
         throw std::runtime_error("error in data stream");
     }
+    // bytes of the partial message are kept until it is complete
+    if (m_unpacker.message_size() > m_max_message_size) {
+        throw std::runtime_error("message size limit exceeded");
+    }
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::setReceiveLimits(std::size_t maxMessageSize,
+                                                                            const msgpack::unpack_limit& limits) {
+    m_max_message_size = maxMessageSize;
+    m_unpack_limit = limits;
+    m_renew_unpacker = true;
+    renewUnpacker();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::shrinkBuffers() {
+    renewUnpacker();
+    m_frame = msgpack::sbuffer();
+    std::string().swap(m_compressed);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::renewUnpacker() {
+    // replace unpacker only between messages, retained messages keep their part of the old buffer
+    if (m_unpacker.message_size() > 0) {
+        return false;
+    }
+    m_unpacker = msgpack::unpacker(&referenceData, nullptr, MSGPACK_UNPACKER_INIT_BUFFER_SIZE, m_unpack_limit);
+    m_renew_unpacker = false;
+    return true;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::dispatch(const msgpack::object& message) {
+    // message is array of objects, inspected in place
+    if (message.type != msgpack::type::ARRAY || message.via.array.size < 1 || !isId(message.via.array.ptr[0])) {
+        return false;
+    }
+    const msgpack::object* items = message.via.array.ptr;
+    const std::uint32_t n_items = message.via.array.size;
+
+    // determine message type and call the corresponding handler
+    std::string_view name;
+    RequestOptions options;
+    switch (static_cast<MessageType>(items[0].via.u64)) {
+    case MessageType::Request:
+        // request: (type=request, method, args, id, [options])
+        if (n_items < 4 || !nameView(items[1], name) || !isId(items[3])) {
+            return false;
+        }
+        if (n_items >= 5 && !parseOptions(items[4], options)) {
+            return false;
+        }
+        m_handler.handleRequest(name, items[2], items[3].via.u64, options);
+        break;
+    case MessageType::Response:
+        // response: (type=response, id, result)
+        if (n_items < 3 || !isId(items[1])) {
+            return false;
+        }
+        m_handler.handleResponse(items[1].via.u64, items[2]);
+        break;
+    case MessageType::Error:
+        // error: (type=error, id, error)
+        if (n_items < 3 || !isId(items[1]) || !isString(items[2])) {
+            return false;
+        }
+        m_handler.handleError(items[1].via.u64, stringView(items[2]));
+        break;
+    case MessageType::Event:
+        // event: (type=event, name, args)
+        if (n_items < 3 || !nameView(items[1], name)) {
+            return false;
+        }
+        m_handler.handleEvent(name, items[2]);
+        break;
+    case MessageType::EventBatch:
+        // event batch: (type=eventbatch, name, [args, ...])
+        if (n_items < 3 || !nameView(items[1], name) || items[2].type != msgpack::type::ARRAY) {
+            return false;
+        }
+        m_handler.handleEventBatch(name, items[2]);
+        break;
+    case MessageType::Hello:
+        // hello: (type=hello, [feature, ...])
+        if (n_items < 2 || items[1].type != msgpack::type::ARRAY) {
+            return false;
+        }
+        m_remote_features.clear();
+        for (std::uint32_t i = 0; i < items[1].via.array.size; ++i) {
+            if (isString(items[1].via.array.ptr[i])) {
+                m_remote_features.emplace_back(stringView(items[1].via.array.ptr[i]));
+            }
+        }
+        m_intern_names = remoteSupports("intern");
+        m_remote_compression = remoteSupports("zlib");
+        m_remote_typed_arrays = remoteSupports("typedarrays");
+        m_handler.handleHello();
+        break;
+    case MessageType::Compressed:
+        // compressed: (type=compressed, data), data holds one or more compressed messages
+        if (n_items < 2 || items[1].type != msgpack::type::BIN) {
+            return false;
+        }
+        return dispatchCompressed(items[1]);
+    case MessageType::Cancel:
+        // cancel: (type=cancel, id)
+        if (n_items < 2 || !isId(items[1])) {
+            return false;
+        }
+        m_handler.handleCancel(items[1].via.u64);
+        break;
+    case MessageType::StreamItems:
+        // stream items: (type=streamitems, id, [item, ...])
+        if (n_items < 3 || !isId(items[1]) || items[2].type != msgpack::type::ARRAY) {
+            return false;
+        }
+        m_handler.handleStreamItems(items[1].via.u64, items[2]);
+        break;
+    case MessageType::StreamCredit:
+        // stream credit: (type=streamcredit, id, n)
+        if (n_items < 3 || !isId(items[1]) || items[2].type != msgpack::type::POSITIVE_INTEGER) {
+            return false;
+        }
+        m_handler.handleStreamCredit(items[1].via.u64, items[2].via.u64);
+        break;
+    case MessageType::BlobBegin:
+        // blob begin: (type=blobbegin, id, name, size)
+        if (n_items < 4 || !isId(items[1]) || !isString(items[2]) || !isId(items[3])) {
+            return false;
+        }
+        m_handler.handleBlobBegin(items[1].via.u64, stringView(items[2]), items[3].via.u64);
+        break;
+    case MessageType::BlobChunk:
+        // blob chunk: (type=blobchunk, id, data)
+        if (n_items < 3 || !isId(items[1]) || items[2].type != msgpack::type::BIN) {
+            return false;
+        }
+        m_handler.handleBlobChunk(items[1].via.u64, items[2].via.bin.ptr, items[2].via.bin.size);
+        break;
+    case MessageType::BlobEnd:
+        // blob end: (type=blobend, id, [error])
+        if (n_items < 2 || !isId(items[1]) || (n_items >= 3 && !isString(items[2]))) {
+            return false;
+        }
+        m_handler.handleBlobEnd(items[1].via.u64, (n_items >= 3) ? stringView(items[2]) : std::string_view());
+        break;
+    case MessageType::Batch:
+        // batch: (type=batch, [message, ...]), batches are not nested
+        if (n_items < 2 || items[1].type != msgpack::type::ARRAY || m_in_batch) {
+            return false;
+        }
+        m_in_batch = true;
+        m_handler.beginBatch();
+        for (std::uint32_t i = 0; i < items[1].via.array.size; ++i) {
+            if (!dispatch(items[1].via.array.ptr[i])) {
+                m_in_batch = false;
+                return false;
+            }
+        }
+        m_in_batch = false;
+        m_handler.endBatch();
+        break;
+    case MessageType::DefineName:
+        // define name: (type=definename, id, name), ids are assigned in sequence
+        if (n_items < 3 || !isId(items[1]) || items[1].via.u64 != m_remote_names.size() || !isString(items[2])) {
+            return false;
+        }
+        // names are never released, limit the memory a remote peer can claim
+        if (m_remote_names.size() >= s_max_interned_names) {
+            return false;
+        }
+        m_remote_names.emplace_back(stringView(items[2]));
+        break;
+    case MessageType::Subscribe:
+    case MessageType::Unsubscribe:
+        // (un)subscribe: (type=subscribe/unsubscribe, patterns)
+        if (n_items < 2 || items[1].type != msgpack::type::ARRAY) {
+            return false;
+        }
+        m_handler.handleSubscription(static_cast<MessageType>(items[0].via.u64) == MessageType::Subscribe, items[1]);
+        break;
+    default:
+        break;
+    }
+    return true;
+}
+
+
+template <class IStream, class OStream, class Handler>
+template <typename Range>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendHello(const Range& features) {
+    m_frame.clear();
+    m_packer.pack_array(2);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::Hello));
+    m_packer.pack_array(static_cast<std::uint32_t>(std::size(features)));
+    for (std::string_view feature: features) {
+        packString(m_packer, feature);
+    }
+    writeFrame();
+    m_hello_sent = true;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline std::optional<std::uint64_t> MsgpackRpcProtocol<IStream, OStream, Handler>::internName(std::string_view name) {
+    // look up name id, defining the name in front of the current message on first use
+    if (!m_intern_names) {
+        return std::nullopt;
+    }
+    const auto it = m_local_names.find(name);
+    if (it != m_local_names.end()) {
+        return it->second;
+    }
+    if (m_local_names.size() >= s_max_interned_names) {
+        return std::nullopt;
+    }
+    const std::uint64_t id = m_local_names.size();
+    m_local_names.emplace(name, id);
+    m_packer.pack_array(3);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::DefineName));
+    m_packer.pack(id);
+    packString(m_packer, name);
+    m_frame_prefix = m_frame.size();
+    return id;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::packName(std::string_view name, std::optional<std::uint64_t> id) {
+    if (id) {
+        m_packer.pack(*id);
+    } else {
+        packString(m_packer, name);
+    }
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::nameView(const msgpack::object& o, std::string_view& name) const {
+    if (isString(o)) {
+        name = stringView(o);
+        return true;
+    }
+    if (isId(o) && o.via.u64 < m_remote_names.size()) {
+        name = m_remote_names[o.via.u64];
+        return true;
+    }
+    return false;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::parseOptions(const msgpack::object& o, RequestOptions& options) {
+    if (o.type == msgpack::type::NIL) {
+        return true;
+    }
+    if (o.type != msgpack::type::MAP) {
+        return false;
+    }
+    // unknown options are ignored
+    for (std::uint32_t i = 0; i < o.via.map.size; ++i) {
+        const auto& [key, value] = o.via.map.ptr[i];
+        if (!isString(key) || value.type != msgpack::type::POSITIVE_INTEGER) {
+            continue;
+        }
+        if (stringView(key) == "timeout") {
+            options.timeout = static_cast<std::int64_t>(value.via.u64);
+        } else if (stringView(key) == "stream") {
+            options.stream = static_cast<std::int64_t>(value.via.u64);
+        }
+    }
+    return true;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::packOptions(const RequestOptions& options) {
+    m_packer.pack_map((options.timeout >= 0 ? 1 : 0) + (options.stream >= 0 ? 1 : 0));
+    if (options.timeout >= 0) {
+        packString(m_packer, "timeout");
+        m_packer.pack(static_cast<std::uint64_t>(options.timeout));
+    }
+    if (options.stream >= 0) {
+        packString(m_packer, "stream");
+        m_packer.pack(static_cast<std::uint64_t>(options.stream));
+    }
 }
 
 
 template <class IStream, class OStream, class Handler>
 template <typename T>
-inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendRequest(const std::string& method, const T& v, std::uint64_t id) {
-    m_packer.pack_array(4);
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendRequest(std::string_view method, const T& v, std::uint64_t id,
+                                                                       const RequestOptions& options) {
+    m_frame.clear();
+    const auto nameId = internName(method);
+    m_packer.pack_array(options.isEmpty() ? 4 : 5);
     m_packer.pack(static_cast<std::uint8_t>(MessageType::Request));
-    m_packer.pack(method);
+    packName(method, nameId);
     m_packer.pack(v);
     m_packer.pack(id);
+    if (!options.isEmpty()) {
+        packOptions(options);
+    }
+    writeFrame();
 }
 
 
 template <class IStream, class OStream, class Handler>
 template <typename T>
 inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendResponse(std::uint64_t id, const T& v) {
+    beginResponse(id).pack(v);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+template <typename Range>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendRequestBatch(const Range& requests) {
+    m_frame.clear();
+    // define names in front of the batch
+    std::vector<std::optional<std::uint64_t>> nameIds;
+    nameIds.reserve(std::size(requests));
+    for (const auto& request: requests) {
+        nameIds.push_back(internName(std::get<0>(request)));
+    }
+    m_packer.pack_array(2);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::Batch));
+    m_packer.pack_array(static_cast<std::uint32_t>(std::size(requests)));
+    auto nameId = nameIds.cbegin();
+    for (const auto& [method, v, id, options]: requests) {
+        m_packer.pack_array(options.isEmpty() ? 4 : 5);
+        m_packer.pack(static_cast<std::uint8_t>(MessageType::Request));
+        packName(method, *nameId++);
+        m_packer.pack(v);
+        m_packer.pack(id);
+        if (!options.isEmpty()) {
+            packOptions(options);
+        }
+    }
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+template <typename Range>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendBatch(const Range& messages) {
+    m_frame.clear();
+    m_packer.pack_array(2);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::Batch));
+    m_packer.pack_array(static_cast<std::uint32_t>(std::size(messages)));
+    for (const auto& message: messages) {
+        m_frame.write(message.data(), message.size());
+    }
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline msgpack::packer<msgpack::sbuffer>& MsgpackRpcProtocol<IStream, OStream, Handler>::beginResponse(std::uint64_t id) {
+    m_frame.clear();
+    packResponseHeader(m_packer, id);
+    return m_packer;
+}
+
+
+template <typename Stream>
+inline void MsgpackRpcMessage::packResponseHeader(msgpack::packer<Stream>& packer, std::uint64_t id) {
+    packer.pack_array(3);
+    packer.pack(static_cast<std::uint8_t>(MessageType::Response));
+    packer.pack(id);
+}
+
+
+template <typename Stream>
+inline void MsgpackRpcMessage::packError(msgpack::packer<Stream>& packer, std::uint64_t id, std::string_view errorstr) {
+    packer.pack_array(3);
+    packer.pack(static_cast<std::uint8_t>(MessageType::Error));
+    packer.pack(id);
+    packString(packer, errorstr);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::endMessage() {
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendError(std::uint64_t id, std::string_view errorstr) {
+    m_frame.clear();
+    packError(m_packer, id, errorstr);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendCancel(std::uint64_t id) {
+    m_frame.clear();
+    m_packer.pack_array(2);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::Cancel));
+    m_packer.pack(id);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+template <typename Range>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendStreamItems(std::uint64_t id, const Range& items) {
+    m_frame.clear();
     m_packer.pack_array(3);
-    m_packer.pack(static_cast<std::uint8_t>(MessageType::Response));
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::StreamItems));
     m_packer.pack(id);
-    m_packer.pack(v);
+    m_packer.pack_array(static_cast<std::uint32_t>(std::size(items)));
+    for (const auto& item: items) {
+        m_packer.pack(item);
+    }
+    writeFrame();
 }
 
 
 template <class IStream, class OStream, class Handler>
-inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendError(std::uint64_t id, const std::string& errorstr) {
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendStreamCredit(std::uint64_t id, std::uint64_t n) {
+    m_frame.clear();
     m_packer.pack_array(3);
-    m_packer.pack(static_cast<std::uint8_t>(MessageType::Error));
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::StreamCredit));
+    m_packer.pack(id);
+    m_packer.pack(n);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendBlobBegin(std::uint64_t id, std::string_view name,
+                                                                         std::uint64_t size) {
+    m_frame.clear();
+    m_packer.pack_array(4);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::BlobBegin));
+    m_packer.pack(id);
+    packString(m_packer, name);
+    m_packer.pack(size);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendBlobChunk(std::uint64_t id, const char* data,
+                                                                         std::size_t size) {
+    // message header up to the bin header, followed by the chunk data
+    m_frame.clear();
+    m_packer.pack_array(3);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::BlobChunk));
+    m_packer.pack(id);
+    m_packer.pack_bin(static_cast<std::uint32_t>(size));
+    // the header is incomplete without the chunk data, never compress it
+    m_ostream.write(m_frame.data(), m_frame.size());
+    m_ostream.write(data, size);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendBlobEnd(std::uint64_t id, std::string_view error) {
+    m_frame.clear();
+    m_packer.pack_array(error.empty() ? 2 : 3);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::BlobEnd));
     m_packer.pack(id);
-    m_packer.pack(errorstr);
+    if (!error.empty()) {
+        packString(m_packer, error);
+    }
+    writeFrame();
 }
 
 
 template <class IStream, class OStream, class Handler>
 template <typename T>
-inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendEvent(const std::string& name, const T& v) {
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendEvent(std::string_view name, const T& v) {
+    m_frame.clear();
+    const auto nameId = internName(name);
     m_packer.pack_array(3);
     m_packer.pack(static_cast<std::uint8_t>(MessageType::Event));
-    m_packer.pack(name);
+    packName(name, nameId);
     m_packer.pack(v);
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendEventPayload(std::string_view name, const char* payload, std::size_t size) {
+    m_frame.clear();
+    const auto nameId = internName(name);
+    m_packer.pack_array(3);
+    m_packer.pack(static_cast<std::uint8_t>(MessageType::Event));
+    packName(name, nameId);
+    m_frame.write(payload, size);
+    writeFrame();
+}
+
+
+template <typename Stream, typename T>
+inline void MsgpackRpcMessage::packEvent(msgpack::packer<Stream>& packer, std::string_view name, const T& v) {
+    packEventHeader(packer, name);
+    packer.pack(v);
+}
+
+
+template <typename Stream>
+inline void MsgpackRpcMessage::packEventHeader(msgpack::packer<Stream>& packer, std::string_view name) {
+    packer.pack_array(3);
+    packer.pack(static_cast<std::uint8_t>(MessageType::Event));
+    packString(packer, name);
+}
+
+
+template <typename Stream, typename Range>
+inline void MsgpackRpcMessage::packEventBatch(msgpack::packer<Stream>& packer, std::string_view name, const Range& items) {
+    packer.pack_array(3);
+    packer.pack(static_cast<std::uint8_t>(MessageType::EventBatch));
+    packString(packer, name);
+    packer.pack_array(static_cast<std::uint32_t>(items.size()));
+    for (const auto& item: items) {
+        packer.pack(item);
+    }
+}
+
+
+template <class IStream, class OStream, class Handler>
+template <typename Range>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendSubscription(bool subscribe, const Range& patterns) {
+    m_frame.clear();
+    m_packer.pack_array(2);
+    m_packer.pack(static_cast<std::uint8_t>(subscribe ? MessageType::Subscribe : MessageType::Unsubscribe));
+    m_packer.pack_array(static_cast<std::uint32_t>(patterns.size()));
+    for (const auto& pattern: patterns) {
+        m_packer.pack(pattern);
+    }
+    writeFrame();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendFrame(const char* data, std::size_t size) {
+    // pre-encoded message, bypass frame buffer
+    writeMessage(data, size);
+}
+
+
+template <typename Stream>
+inline void MsgpackRpcMessage::packString(msgpack::packer<Stream>& packer, std::string_view str) {
+    const auto size = static_cast<std::uint32_t>(str.size());
+    packer.pack_str(size);
+    packer.pack_str_body(str.data(), size);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::writeFrame() {
+    const std::size_t prefix = std::exchange(m_frame_prefix, 0);
+    if (prefix == 0) {
+        // hand the complete message to the output stream in one piece
+        writeMessage(m_frame.data(), m_frame.size());
+        return;
+    }
+    // name definitions are sent in front of a compressed message, compressed data holds a single message
+    const std::size_t size = m_frame.size() - prefix;
+    if (!compresses(size)) {
+        m_ostream.write(m_frame.data(), m_frame.size());
+        return;
+    }
+    m_ostream.write(m_frame.data(), prefix);
+    writeMessage(m_frame.data() + prefix, size);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::writeMessage(const char* data, std::size_t size) {
+    if (!compresses(size)) {
+        m_ostream.write(data, size);
+        return;
+    }
+    // send compressed message only if it is smaller, including the message header
+    m_compressed.clear();
+    m_compressed_header.clear();
+    if (compressMessage(data, size, m_compressed_header, m_compressed)) {
+        sendCompressed(size, m_compressed_header, m_compressed);
+    } else {
+        sendIncompressible(data, size);
+    }
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::compressMessage(const char* data, std::size_t size,
+                                                                           msgpack::sbuffer& header,
+                                                                           std::string& compressed) const {
+    if (!m_compress || !m_compress(data, size, compressed)) {
+        return false;
+    }
+    msgpack::packer<msgpack::sbuffer> packer(header);
+    packer.pack_array(2);
+    packer.pack(static_cast<std::uint8_t>(MessageType::Compressed));
+    packer.pack_bin(static_cast<std::uint32_t>(compressed.size()));
+    return header.size() + compressed.size() < size;
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendCompressed(std::size_t size, const msgpack::sbuffer& header,
+                                                                          const std::string& compressed) {
+    m_ostream.write(header.data(), header.size());
+    m_ostream.write(compressed.data(), compressed.size());
+    ++m_n_compressed;
+    m_bytes_uncompressed += size;
+    m_bytes_compressed += header.size() + compressed.size();
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline void MsgpackRpcProtocol<IStream, OStream, Handler>::sendIncompressible(const char* data, std::size_t size) {
+    ++m_n_incompressible;
+    m_ostream.write(data, size);
+}
+
+
+template <class IStream, class OStream, class Handler>
+inline bool MsgpackRpcProtocol<IStream, OStream, Handler>::dispatchCompressed(const msgpack::object& data) {
+    // compressed messages are not nested
+    std::string message;
+    if (m_in_compressed || !m_decompress || !m_decompress(data.via.bin.ptr, data.via.bin.size, message)) {
+        return false;
+    }
+    // objects of the decompressed message own their data, handlers may retain it like any other message
+    if (message.size() > m_max_message_size) {
+        return false;
+    }
+    // dispatch every message of the decompressed data, peers may compress several messages at once
+    auto outer = m_message;
+    m_in_compressed = true;
+    bool ok = true;
+    std::size_t offset = 0;
+    while (ok && offset < message.size()) {
+        m_message = std::make_shared<msgpack::object_handle>(
+            msgpack::unpack(message.data(), message.size(), offset, nullptr, nullptr, m_unpack_limit));
+        ok = dispatch(m_message->get());
+    }
+    m_in_compressed = false;
+    m_message = std::move(outer);
+    return ok;
 }
@@ -0,0 +1,116 @@
+#pragma once
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <optional>
+#include <utility>
+#include <vector>
+
+
+/**
+ * Table of values keyed by increasing ids, e.g. the pending responses of sent
+ * requests. Values are stored in a ring of slots indexed by the lower bits of
+ * their id, inserting and taking values does not allocate once the ring is
+ * large enough for the ids in use. The ring grows while more than half of its
+ * slots are in use, long-lived values are moved to an overflow map otherwise
+ * if a newer id needs their slot.
+ */
+template <typename T>
+class PendingTable
+{
+public:
+    explicit PendingTable(std::size_t capacity = 64)
+        : m_slots(std::bit_ceil(std::max<std::size_t>(capacity, 2)))
+    { }
+
+    std::size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // Add value for an id not in the table
+    void insert(std::uint64_t id, T value)
+    {
+        Slot* slot = &slotFor(id);
+        if (slot->value) {
+            if (2 * (m_size - m_overflow.size()) >= m_slots.size()) {
+                grow();
+                slot = &slotFor(id);
+            }
+            if (slot->value) {
+                m_overflow.emplace(slot->id, std::move(*slot->value));
+            }
+        }
+        slot->id = id;
+        slot->value.emplace(std::move(value));
+        ++m_size;
+    }
+
+    // Remove value of id from the table, returns nothing if the id is unknown
+    std::optional<T> take(std::uint64_t id)
+    {
+        std::optional<T> value;
+        Slot& slot = slotFor(id);
+        if (slot.value && slot.id == id) {
+            value.emplace(std::move(*slot.value));
+            slot.value.reset();
+        } else if (!m_overflow.empty()) {
+            auto it = m_overflow.find(id);
+            if (it == m_overflow.end()) {
+                return value;
+            }
+            value.emplace(std::move(it->second));
+            m_overflow.erase(it);
+        } else {
+            return value;
+        }
+        --m_size;
+        return value;
+    }
+
+    // Remove all values from the table
+    std::vector<T> takeAll()
+    {
+        std::vector<T> values;
+        values.reserve(m_size);
+        for (auto& slot: m_slots) {
+            if (slot.value) {
+                values.push_back(std::move(*slot.value));
+                slot.value.reset();
+            }
+        }
+        for (auto& kv: m_overflow) {
+            values.push_back(std::move(kv.second));
+        }
+        m_overflow.clear();
+        m_size = 0;
+        return values;
+    }
+
+private:
+    struct Slot
+    {
+        std::uint64_t id = 0;
+        std::optional<T> value;
+    };
+
+    Slot& slotFor(std::uint64_t id) { return m_slots[id & (m_slots.size() - 1)]; }
+
+    void grow()
+    {
+        // Ids sharing a slot after growing already shared a slot before, moving values cannot collide
+        std::vector<Slot> slots(2 * m_slots.size());
+        for (auto& slot: m_slots) {
+            if (slot.value) {
+                Slot& target = slots[slot.id & (slots.size() - 1)];
+                target.id = slot.id;
+                target.value = std::move(slot.value);
+            }
+        }
+        m_slots = std::move(slots);
+    }
+
+    std::vector<Slot> m_slots;
+    std::map<std::uint64_t, T> m_overflow;
+    std::size_t m_size = 0;
+};
@@ -3,49 +3,258 @@
 #include <QtCore/QTimer>
 #include <QtCore/QByteArray>
 #include <QtCore/QDebug>
+#include <QtCore/QFile>
+#include <QtCore/QFileInfo>
+#include <QtCore/QMutex>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QStringEncoder>
+#include <QtCore/QVarLengthArray>
+#include <QtCore/QPointer>
+#include <QtCore/QtEndian>
+#include <QtNetwork/QAbstractSocket>
+#include <QRpcHandler.hpp>
 #include "MsgpackRpcProtocol.hpp"
+#include "PendingTable.hpp"
 #include "QtMsgpackAdaptor.hpp"
+#include "RingBuffer.hpp"
+#include "TimerWheel.hpp"
+#include "Tracing.hpp"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <string_view>
+
+
+static inline QString fromUtf8(std::string_view str)
+{
+    return QString::fromUtf8(str.data(), static_cast<qsizetype>(str.size()));
+}
+
+static inline std::string_view toStringView(const QByteArray& str)
+{
+    return {str.constData(), static_cast<std::size_t>(str.size())};
+}
+
+// UTF-8 encoding of short strings without allocating, e.g. for method names of sent requests
+class Utf8Buffer
+{
+public:
+    explicit Utf8Buffer(QStringView str)
+    {
+        QStringEncoder encoder(QStringEncoder::Utf8);
+        m_data.resize(encoder.requiredSpace(str.size()));
+        const char* end = encoder.appendToBuffer(m_data.data(), str);
+        m_data.resize(end - m_data.constData());
+    }
+
+    std::string_view view() const { return {m_data.constData(), static_cast<std::size_t>(m_data.size())}; }
+
+private:
+    QVarLengthArray<char, 256> m_data;
+};
+
+// Context of the request currently being handled by this thread
+static thread_local const QRpcRequestContext* t_current_request = nullptr;
+
+// Maximum number of items sent in one message of a streamed response
+static constexpr qsizetype s_stream_chunk_items = 64;
+
+// Maximum number of stream items collected into a single response for clients not reading streams
+static constexpr qsizetype s_max_collected_items = 65536;
+
+// Limit for methods with separate metrics, protecting against clients sending arbitrary names
+static constexpr qsizetype s_max_method_stats = 1024;
+
+// Size of the chunks blobs are sent in
+static constexpr qint64 s_blob_chunk_size = 256 * 1024;
+
+// Socket read buffer size while reads are paused
+static constexpr qint64 s_paused_read_buffer_size = 64 * 1024;
+
+// Protocol features announced to the remote peer
+static constexpr std::array<std::string_view, 4> s_features{"intern", "batch", "zlib", "typedarrays"};
+
+// Time without traffic after which buffers grown by large messages are released
+static constexpr int s_default_idle_timeout = 30000;
+
+// Compression level favoring speed, large payloads with repeated keys compress well anyway
+static constexpr int s_compression_level = 1;
+
+// Minimum size of encoded events compressed once for all peers, smaller ones are compressed per peer
+static constexpr qsizetype s_shared_compression_size = 1024;
+
+// Time after which finished replies of a batch are sent without waiting for its slower requests
+static constexpr int s_batch_reply_deadline = 10;
+
+
+static bool compressMessage(const char* data, std::size_t size, std::string& out)
+{
+    const QByteArray compressed = qCompress(reinterpret_cast<const uchar*>(data), static_cast<qsizetype>(size),
+                                            s_compression_level);
+    if (compressed.isEmpty()) {
+        return false;
+    }
+    out.assign(compressed.constData(), static_cast<std::size_t>(compressed.size()));
+    return true;
+}
+
+static bool decompressMessage(const char* data, std::size_t size, std::string& out, std::size_t maxSize)
+{
+    // qCompress prefixes the data with its uncompressed size, check it against the limit for
+    // received messages before decompressing, protecting against decompression bombs
+    if (size < sizeof(quint32) || qFromBigEndian<quint32>(data) > maxSize) {
+        return false;
+    }
+    const QByteArray message = qUncompress(reinterpret_cast<const uchar*>(data), static_cast<qsizetype>(size));
+    if (message.isEmpty()) {
+        return false;
+    }
+    out.assign(message.constData(), static_cast<std::size_t>(message.size()));
+    return true;
+}
 
 
 class WriteBuffer {
-    // TODO: This should be implemented as ring buffer
 public:
-    WriteBuffer(QIODevice* device, QObject* ctx) : m_device(device) {
-        QObject::connect(device, &QIODevice::bytesWritten, ctx, [this](){
+    // Amount of data handed to the device before keeping it in the ring buffer
+    static constexpr qint64 s_device_chunk = 64 * 1024;
+
+    WriteBuffer(QIODevice* device, QRpcPeer* peer) : m_device(device), m_peer(peer) {
+        QObject::connect(device, &QIODevice::bytesWritten, peer, [this](){
             // Device finished writing, check for buffered data
-            if (!m_buffer.isEmpty()) {
-                // Try to write buffered data to device
-                int n_buffer = m_buffer.size();
-                const char* p = m_buffer.constData() + m_buffer_pos;
-                qint64 n_written = m_device->write(p, n_buffer - m_buffer_pos);
-                m_buffer_pos += n_written;
-                // Clear buffer when done
-                if (m_buffer_pos == n_buffer) {
-                    m_buffer.clear();
-                    m_buffer_pos = 0;
-                }
-            }
+            flush();
         });
     }
 
     void write(const char *data, qint64 n_data) {
-        if (!m_buffer.isEmpty()) {
+        if (!m_device->isWritable()) {
+            return;
+        }
+        m_bytes_written.add(static_cast<quint64>(n_data));
+        if (m_corked) {
+            // Collect data and write it to the device once per event loop iteration
+            m_buffer.append(data, static_cast<std::size_t>(n_data));
+            scheduleFlush();
+        } else if (!m_buffer.isEmpty() || m_device->bytesToWrite() >= s_device_chunk) {
             // Append new data to buffer if there is queued data
-            m_buffer.append(data, static_cast<int>(n_data));
+            m_buffer.append(data, static_cast<std::size_t>(n_data));
         } else {
             // Try to write new data to device
-            auto n_written = m_device->write(data, n_data);
+            auto n_written = std::max<qint64>(m_device->write(data, n_data), 0);
+            QRPC_TRACE(BytesFlushed, m_peer, 0, QStringView(), n_written);
             // Append residual data to buffer
             if (n_written < n_data) {
-                m_buffer.append(data + n_written, static_cast<int>(n_data - n_written));
+                m_buffer.append(data + n_written, static_cast<std::size_t>(n_data - n_written));
+            }
+        }
+        checkHighWatermark();
+    }
+
+    // Release memory of a ring grown by a burst, once its data was written
+    void shrink() { m_buffer.shrink(); }
+
+    void flush() {
+        // Move buffered data to the device, but don't let the device buffer grow unbounded
+        while (!m_buffer.isEmpty() && m_device->isWritable() && m_device->bytesToWrite() < s_device_chunk) {
+            qint64 n_written = m_device->write(m_buffer.readPointer(), static_cast<qint64>(m_buffer.readSize()));
+            if (n_written <= 0) {
+                break;
+            }
+            m_buffer.consume(static_cast<std::size_t>(n_written));
+            QRPC_TRACE(BytesFlushed, m_peer, 0, QStringView(), n_written);
+        }
+        checkLowWatermark();
+    }
+
+    void setCorked(bool corked) {
+        m_corked = corked;
+        if (!m_corked) {
+            flush();
+        }
+    }
+
+    bool isCorked() const { return m_corked; }
+
+    qint64 bytesToWrite() const {
+        return static_cast<qint64>(m_buffer.size()) + m_device->bytesToWrite();
+    }
+
+    bool isFull() const { return m_full; }
+
+    bool dropEvents() const {
+        return m_full && m_policy == QRpcPeer::SlowConsumerPolicy::DropEvents;
+    }
+
+    qint64 m_low_watermark = 1 * 1024 * 1024;
+    qint64 m_high_watermark = 4 * 1024 * 1024;
+    QRpcPeer::SlowConsumerPolicy m_policy = QRpcPeer::SlowConsumerPolicy::Buffer;
+    QRpcCounter m_bytes_written;
+
+private:
+    void scheduleFlush() {
+        if (m_flush_scheduled) {
+            return;
+        }
+        m_flush_scheduled = true;
+        QMetaObject::invokeMethod(m_peer, [this]() {
+            m_flush_scheduled = false;
+            flush();
+        }, Qt::QueuedConnection);
+    }
+
+    void checkHighWatermark() {
+        if (m_full || bytesToWrite() <= m_high_watermark) {
+            return;
+        }
+        m_full = true;
+        emit m_peer->writeBufferFull();
+        switch (m_policy) {
+        case QRpcPeer::SlowConsumerPolicy::Disconnect:
+        {
+            qWarning() << "QRpcPeer: Disconnecting slow consumer";
+            m_buffer.clear();
+            if (auto* socket = qobject_cast<QAbstractSocket*>(m_device)) {
+                socket->abort();
+            } else {
+                m_device->close();
             }
+            checkLowWatermark();
+        }
+        break;
+        default:
+            break;
+        }
+    }
+
+    void checkLowWatermark() {
+        if (!m_full || bytesToWrite() > m_low_watermark) {
+            return;
         }
+        m_full = false;
+        emit m_peer->writeBufferDrained();
     }
 
-    qint64 m_buffer_pos = 0;
     QIODevice* m_device;
-    QByteArray m_buffer;
+    QRpcPeer* m_peer;
+    RingBuffer m_buffer;
+    bool m_corked = false;
+    bool m_flush_scheduled = false;
+    bool m_full = false;
+};
+
+
+// Compressed frame of an encoded event, compressed by the first peer sending it compressed
+struct QRpcEncodedEvent::CompressedFrame
+{
+    std::once_flag once;
+    bool smaller = false;
+    msgpack::sbuffer header;
+    std::string data;
 };
 
 
@@ -56,26 +265,287 @@ public:
         , m_device(device)
         , m_buffered_device(device, base)
         , m_protocol(*device, m_buffered_device, *this)
+        , m_timeout_timer(new QTimer(base))
+        , m_idle_timer(new QTimer(base))
     {
-        // Register QRpcPromise once
+        // Register QRpcPromise and QRpcStreamGenerator once
         [[maybe_unused]] static int promiseTypeId = qRegisterMetaType<QRpcPromise>();
+        [[maybe_unused]] static int generatorTypeId = qRegisterMetaType<QRpcStreamGenerator>();
+        [[maybe_unused]] static bool bytesConverter = QMetaType::registerConverter<msgpack::QtSharedBytes, QByteArray>(
+            &msgpack::QtSharedBytes::toByteArray);
+        m_protocol.m_compress = compressMessage;
+        m_protocol.m_decompress = [this](const char* data, std::size_t size, std::string& out) {
+            return decompressMessage(data, size, out, m_receive_limits.maxMessageSize);
+        };
+        setReceiveLimits(m_receive_limits);
+        // Shrink buffers if there was no traffic since the last check
+        m_idle_timer->setInterval(s_default_idle_timeout);
+        QObject::connect(m_idle_timer, &QTimer::timeout, base, [this]() {
+            const quint64 n_bytes = m_bytes_received.value() + m_buffered_device.m_bytes_written.value();
+            if (n_bytes == m_idle_bytes && m_buffered_device.bytesToWrite() == 0) {
+                m_protocol.shrinkBuffers();
+                m_buffered_device.shrink();
+            }
+            m_idle_bytes = n_bytes;
+        });
+        m_idle_timer->start();
+        // Check request timeouts while requests with timeout are pending
+        m_timeout_timer->setInterval(static_cast<int>(m_timeouts.resolution()));
+        QObject::connect(m_timeout_timer, &QTimer::timeout, base, [this]() {
+            expireRequests();
+        });
+        // Stop reading requests producing more replies while the remote peer does not keep up
+        QObject::connect(base, &QRpcPeer::writeBufferFull, base, [this]() {
+            updateReadPause();
+        });
+        // Resume streams and blobs paused by a full write buffer
+        QObject::connect(base, &QRpcPeer::writeBufferDrained, base, [this]() {
+            updateReadPause();
+            std::vector<std::uint64_t> ids;
+            for (const auto& kv: m_out_streams) {
+                ids.push_back(kv.first);
+            }
+            for (const auto id: ids) {
+                pumpStream(id);
+            }
+            pumpBlobs();
+        });
     }
 
-    void handleRequest(const std::string& method, const msgpack::object& o, std::uint64_t id);
+    void handleRequest(std::string_view method, const msgpack::object& o, std::uint64_t id,
+                       const MsgpackRpcMessage::RequestOptions& options);
     void handleResponse(std::uint64_t id, const msgpack::object& o);
-    void handleError(std::uint64_t id, const std::string& e);
-    void handleEvent(const std::string& name, const msgpack::object& o);
+    void handleError(std::uint64_t id, std::string_view e);
+    void handleCancel(std::uint64_t id);
+    void handleStreamItems(std::uint64_t id, const msgpack::object& items);
+    void handleStreamCredit(std::uint64_t id, std::uint64_t n);
+    void handleBlobBegin(std::uint64_t id, std::string_view name, std::uint64_t size);
+    void handleBlobChunk(std::uint64_t id, const char* data, std::size_t size);
+    void handleBlobEnd(std::uint64_t id, std::string_view error);
+    void handleEvent(std::string_view name, const msgpack::object& o);
+    void handleEventBatch(std::string_view name, const msgpack::object& items);
+    void handleSubscription(bool subscribe, const msgpack::object& patterns);
+    void handleHello();
+    void beginBatch();
+    void endBatch();
 
+    void readAvailableBytes();
+    void setReceiveLimits(const QRpcReceiveLimits& limits);
+    msgpack::QtZeroCopyScope::Retain zeroCopyRetain() const;
     void cancelPendingResponses();
+    bool acquireSlot(std::shared_ptr<QRpcConcurrencyLimit>& sharedLimit);
+    void drainQueue();
+    void updateReadPause();
+    void watchTimeout(std::uint64_t id, std::chrono::milliseconds timeout);
+    void cancelRequest(std::uint64_t id);
+    void expireRequests();
 
     QRpcPeer* b = nullptr;
     QIODevice* m_device = nullptr;
     WriteBuffer m_buffered_device;
     MsgpackRpcProtocol<QIODevice, WriteBuffer, Private> m_protocol;
     std::uint64_t m_id_count = 1;
+    bool m_reading = false;
+    bool m_read_again = false;
+    bool m_zero_copy = false;
+
+    // Response to a sent request, resolving either a promise or a callback
+    struct PendingResponse
+    {
+        std::optional<std::tuple<QRpcPromise::Resolve, QRpcPromise::Reject>> resolvers;
+        QRpcPeer::ResponseCallback callback;
+
+        void resolve(const QVariant& result) const
+        {
+            if (resolvers) {
+                std::get<0>(*resolvers)(result);
+            } else {
+                callback(result, QString());
+            }
+        }
+
+        void reject(const QString& error) const
+        {
+            if (resolvers) {
+                std::get<1>(*resolvers)(std::runtime_error(error.toStdString()));
+            } else {
+                callback(QVariant(), error);
+            }
+        }
+    };
+    PendingTable<PendingResponse> m_pending_responses;
+    TimerWheel m_timeouts;
+    QTimer* m_timeout_timer = nullptr;
+    std::chrono::milliseconds m_default_timeout{0};
+    std::shared_ptr<const QRpcHandlerRegistry> m_handlers;
+    QStringList m_subscriptions;
+    QRpcReceiveLimits m_receive_limits;
+    // Buffers are shrunk if the number of bytes received and sent did not change for an interval
+    QTimer* m_idle_timer = nullptr;
+    quint64 m_idle_bytes = 0;
+    // Received requests not answered yet, for canceling them
+    std::map<std::uint64_t, QRpcRequestContext> m_in_flight;
+
+    // Replies to the requests of a received batch, sent at once when all requests finished
+    // or the batch deadline passed, replies finishing after the deadline are sent on their own
+    struct Batch
+    {
+        std::deque<msgpack::sbuffer> replies;
+        std::vector<bool> finished;
+        std::size_t n_finished = 0;
+        bool complete = false;
+        bool flushed = false;
+    };
+    // Reply slot in a batch, or empty for replying directly
+    struct BatchReply
+    {
+        std::shared_ptr<Batch> batch;
+        msgpack::sbuffer* buffer = nullptr;
+        std::size_t index = 0;
+    };
+    std::shared_ptr<Batch> m_batch;
+
+    // Requests waiting for processing once the number of requests in process is limited
+    struct QueuedRequest
+    {
+        QString method;
+        QVariant args;
+        std::uint64_t id;
+        QRpcRequestContext context;
+        BatchReply reply;
+        std::int64_t streamCredit;
+        std::shared_ptr<QRpcMethodStats> stats;
+        std::chrono::steady_clock::time_point start;
+        // Typed handlers decode their arguments when invoked, queued requests retain the message until then
+        std::shared_ptr<const QRpcHandler> handler;
+        const msgpack::object* handlerArgs = nullptr;
+        std::shared_ptr<const msgpack::object_handle> message;
+    };
+    std::deque<QueuedRequest> m_queue;
+    int m_n_processing = 0;
+    int m_max_processing = 0;
+    int m_max_queued = 0;
+    std::shared_ptr<QRpcConcurrencyLimit> m_shared_limit;
+    bool m_pause_reads = false;
+    bool m_read_paused = false;
+    qint64 m_read_buffer_size = 0;
+
+    // Streamed responses sent while the client grants credit, holding their concurrency slot
+    // until the stream ended
+    struct OutStream
+    {
+        QRpcStreamGenerator generator;
+        std::int64_t credit;
+        QRpcRequestContext context;
+        std::function<void()> finish;
+    };
+    std::map<std::uint64_t, OutStream> m_out_streams;
+    OutStream takeStream(std::map<std::uint64_t, OutStream>::iterator stream_iter);
+    // Readers of streamed responses received from the remote peer
+    std::map<std::uint64_t, QPointer<QRpcStreamReader>> m_in_streams;
+
+    // Files sent in chunks from their memory mapping, one after another
+    struct OutBlob
+    {
+        std::uint64_t id;
+        QPointer<QFile> file;
+        const uchar* data;
+        qint64 size;
+        qint64 offset;
+        QRpcPromise::Resolve resolve;
+        QRpcPromise::Reject reject;
+    };
+    std::deque<OutBlob> m_out_blobs;
+    std::uint64_t m_blob_count = 1;
+    // Blobs being received, written to devices provided by the sink factory
+    struct InBlob
+    {
+        QString name;
+        QPointer<QIODevice> sink;
+        QString error;
+    };
+    std::map<std::uint64_t, InBlob> m_in_blobs;
+    QRpcPeer::BlobSinkFactory m_blob_sink_factory;
+
+    void pumpBlobs();
+
+    // Counters readable from any thread, see QRpcPeer::metrics()
+    using Clock = std::chrono::steady_clock;
+    QRpcCounter m_requests_received;
+    QRpcCounter m_requests_sent;
+    QRpcCounter m_bytes_received;
+    QRpcCounter m_pending_depth;
+    QRpcCounter m_write_buffer_depth;
+    QRpcCounter m_in_flight_depth;
+    QRpcCounter m_queued_depth;
+    mutable QReadWriteLock m_method_stats_lock;
+    QHash<QString, std::shared_ptr<QRpcMethodStats>> m_method_stats;
+
+    std::shared_ptr<QRpcMethodStats> methodStats(const QString& method);
+    static void recordLatency(QRpcMethodStats& stats, Clock::time_point start);
+    void updateGauges();
+
+    void sendResult(const BatchReply& reply, std::uint64_t id, const QVariant& result,
+                    std::int64_t streamCredit, const QRpcRequestContext& context, std::function<void()> finish);
+    void pumpStream(std::uint64_t id);
+
+    BatchReply newReply();
+    void finishReply(const BatchReply& reply);
+    void flushBatch(Batch& batch);
+    void sendResponse(const BatchReply& reply, std::uint64_t id, const QVariant& result);
+    void sendError(const BatchReply& reply, std::uint64_t id, std::string_view error);
+    bool finishInFlight(std::uint64_t id, const BatchReply& reply, const QRpcRequestContext& context);
+    void processRequest(QueuedRequest request, std::shared_ptr<QRpcConcurrencyLimit> sharedLimit);
+    void invokeHandler(QueuedRequest request, std::shared_ptr<QRpcConcurrencyLimit> sharedLimit);
+
+    class Response;
+};
+
+
+/**
+ * Response channel writing typed handler results to the peer protocol.
+ */
+class QRpcPeer::Private::Response : public QRpcResponse
+{
+public:
+    Response(QRpcPeer::Private& peer, std::uint64_t id, BatchReply reply)
+        : m_peer(peer), m_id(id), m_reply(std::move(reply)) { }
+
+    void reject(std::string_view error) override
+    {
+        m_failed = true;
+        m_peer.sendError(m_reply, m_id, error);
+    }
+
+    bool failed() const { return m_failed; }
+
+protected:
+    Packer& beginResult() override
+    {
+        if (!m_reply.buffer) {
+            return m_peer.m_protocol.beginResponse(m_id);
+        }
+        m_reply_packer.emplace(*m_reply.buffer);
+        MsgpackRpcMessage::packResponseHeader(*m_reply_packer, m_id);
+        return *m_reply_packer;
+    }
+
+    void endResult() override
+    {
+        if (!m_reply.buffer) {
+            m_peer.m_protocol.endMessage();
+        } else {
+            m_peer.finishReply(m_reply);
+        }
+        QRPC_TRACE(ResponsePacked, m_peer.b, m_id, QStringView(), 0);
+    }
 
-    using Resolvers = std::tuple<QRpcPromise::Resolve, QRpcPromise::Reject>;
-    std::map<std::uint64_t, Resolvers> m_pending_responses;
+private:
+    QRpcPeer::Private& m_peer;
+    std::uint64_t m_id;
+    BatchReply m_reply;
+    std::optional<Packer> m_reply_packer;
+    bool m_failed = false;
 };
 
 QRpcPeer::QRpcPeer(QIODevice* device, QObject *parent)
@@ -83,19 +553,23 @@ QRpcPeer::QRpcPeer(QIODevice* device, QObject *parent)
     , p(std::make_unique<Private>(this, device))
 {
     connect(device, &QIODevice::readyRead, this, [this]() {
-        try {
-            p->m_protocol.readAvailableBytes();
-        } catch (const std::runtime_error& e) {
-            // Close stream on error
-            qWarning() << "QRpcPeer:" << e.what();
-            p->m_device->close();
-        }
+        p->readAvailableBytes();
     });
     // TODO: Cancel pending responses if device is closed/finished
 }
 
 QRpcPeer::~QRpcPeer()
 {
+    // Release slots of unfinished streams without processing queued requests
+    p->m_queue.clear();
+    auto streams = std::move(p->m_out_streams);
+    p->m_out_streams.clear();
+    for (auto& kv: streams) {
+        kv.second.finish();
+    }
+    if (p->m_shared_limit) {
+        p->m_shared_limit->removeWaiter(this);
+    }
     p->cancelPendingResponses();
 }
 
@@ -105,79 +579,1257 @@ QRpcPromise QRpcPeer::sendRequest(const QString& method, const QVariantList& arg
 }
 
 QRpcPromise QRpcPeer::sendRequest(const QString& method, const QVariant& arg)
+{
+    return sendRequest(method, arg, p->m_default_timeout);
+}
+
+QRpcPromise QRpcPeer::sendRequest(const QString& method, const QVariant& arg, std::chrono::milliseconds timeout)
 {
     // Send request to peer
     std::uint64_t id = p->m_id_count++;
-    p->m_protocol.sendRequest(method.toStdString(), arg, id);
+    MsgpackRpcMessage::RequestOptions options;
+    if (timeout.count() > 0) {
+        options.timeout = timeout.count();
+    }
+    msgpack::QtTypedArrayScope typedArrays(p->m_protocol.m_remote_typed_arrays);
+    p->m_protocol.sendRequest(Utf8Buffer(method).view(), arg, id, options);
 
     // Create promise for pending response
-    return [&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
-        p->m_pending_responses.try_emplace(id, resolve, reject);
+    QRpcPromise promise = [&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+        p->m_pending_responses.insert(id, {std::tuple(resolve, reject), {}});
     };
+    promise.onCancel([peer = QPointer<QRpcPeer>(this), id]() {
+        if (!peer.isNull()) {
+            peer->p->cancelRequest(id);
+        }
+    });
+    p->watchTimeout(id, timeout);
+    p->m_requests_sent.add();
+    p->updateGauges();
+    return promise;
 }
 
-void QRpcPeer::sendEvent(const QString& name, const QVariant& data)
+void QRpcPeer::sendRequest(const QString& method, const QVariant& arg, ResponseCallback callback)
 {
-    p->m_protocol.sendEvent(name.toStdString(), data);
-}
+    // Send request to peer
+    std::uint64_t id = p->m_id_count++;
+    MsgpackRpcMessage::RequestOptions options;
+    if (p->m_default_timeout.count() > 0) {
+        options.timeout = p->m_default_timeout.count();
+    }
+    msgpack::QtTypedArrayScope typedArrays(p->m_protocol.m_remote_typed_arrays);
+    p->m_protocol.sendRequest(Utf8Buffer(method).view(), arg, id, options);
 
-QIODevice* QRpcPeer::device()
-{
-    return p->m_device;
+    // Keep callback for pending response
+    p->m_pending_responses.insert(id, {std::nullopt, std::move(callback)});
+    p->watchTimeout(id, p->m_default_timeout);
+    p->m_requests_sent.add();
+    p->updateGauges();
 }
 
-void QRpcPeer::Private::handleRequest(const std::string& method, const msgpack::object& o, std::uint64_t id)
+std::unique_ptr<QRpcStreamReader> QRpcPeer::sendStreamRequest(const QString& method, const QVariant& arg, int credits)
 {
-    QPointer<QRpcPeer> peer(b);
-    auto p = QRpcPromise([&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
-        // Emit signal for new request, forwarding resolvers
-        emit b->newRequest(QString::fromStdString(method), o.as<QVariant>(), resolve, reject);
-    }).then([peer, id](const QVariant& result) {
-        // Send reply once resolved
-        if (!peer.isNull()) {
-            peer->p->m_protocol.sendResponse(id, result);
-        }
-    }).fail([peer, id](const std::exception& e) {
-        // Send error if request was rejected
+    // Send request to peer, granting initial credit for stream items
+    std::uint64_t id = p->m_id_count++;
+    MsgpackRpcMessage::RequestOptions options;
+    options.stream = std::max(credits, 1);
+    if (p->m_default_timeout.count() > 0) {
+        options.timeout = p->m_default_timeout.count();
+    }
+    msgpack::QtTypedArrayScope typedArrays(p->m_protocol.m_remote_typed_arrays);
+    p->m_protocol.sendRequest(Utf8Buffer(method).view(), arg, id, options);
+
+    // Create promise for the end of the stream and reader for its items
+    QRpcPromise promise = [&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+        p->m_pending_responses.insert(id, {std::tuple(resolve, reject), {}});
+    };
+    promise.onCancel([peer = QPointer<QRpcPeer>(this), id]() {
         if (!peer.isNull()) {
-            peer->p->m_protocol.sendError(id, e.what());
+            peer->p->cancelRequest(id);
         }
     });
-    // TODO: Track pending requests somewhere?
+    p->watchTimeout(id, p->m_default_timeout);
+    p->m_requests_sent.add();
+    p->updateGauges();
+    std::unique_ptr<QRpcStreamReader> reader(new QRpcStreamReader(this, id, promise));
+    p->m_in_streams.emplace(id, reader.get());
+    return reader;
 }
 
-void QRpcPeer::Private::handleResponse(std::uint64_t id, const msgpack::object& o) {
-    // Find pending response, ignore response if response ID is unknown
-    auto response_iter = m_pending_responses.find(id);
-    if (response_iter == m_pending_responses.end()) {
+QRpcPromise QRpcPeer::sendFile(QFile* file, const QString& name)
+{
+    if (!file || !file->isOpen()) {
+        return QRpcPromise::reject(std::runtime_error("File not open"));
+    }
+    // Empty files cannot be mapped
+    const qint64 size = file->size();
+    const uchar* data = (size > 0) ? file->map(0, size) : nullptr;
+    if (size > 0 && !data) {
+        return QRpcPromise::reject(std::runtime_error(file->errorString().toStdString()));
+    }
+    const std::uint64_t id = p->m_blob_count++;
+    const QByteArray nameUtf8 = (name.isEmpty() ? QFileInfo(*file).fileName() : name).toUtf8();
+    p->m_protocol.sendBlobBegin(id, toStringView(nameUtf8), static_cast<std::uint64_t>(size));
+    QRpcPromise promise = [&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+        p->m_out_blobs.push_back({id, file, data, size, 0, resolve, reject});
+    };
+    p->pumpBlobs();
+    return promise;
+}
+
+void QRpcPeer::setBlobSinkFactory(BlobSinkFactory factory)
+{
+    p->m_blob_sink_factory = std::move(factory);
+}
+
+void QRpcPeer::setDefaultTimeout(std::chrono::milliseconds timeout)
+{
+    p->m_default_timeout = timeout;
+}
+
+std::chrono::milliseconds QRpcPeer::defaultTimeout() const
+{
+    return p->m_default_timeout;
+}
+
+std::vector<QRpcPromise> QRpcPeer::sendRequests(const std::vector<Request>& requests)
+{
+    std::vector<QRpcPromise> promises;
+    promises.reserve(requests.size());
+    if (!p->m_protocol.remoteSupports("batch")) {
+        for (const auto& [method, arg]: requests) {
+            promises.push_back(sendRequest(method, arg));
+        }
+        return promises;
+    }
+
+    // Send all requests in a single batch message
+    MsgpackRpcMessage::RequestOptions options;
+    if (p->m_default_timeout.count() > 0) {
+        options.timeout = p->m_default_timeout.count();
+    }
+    std::vector<QByteArray> methodsUtf8;
+    methodsUtf8.reserve(requests.size());
+    std::vector<std::tuple<std::string_view, const QVariant&, std::uint64_t, MsgpackRpcMessage::RequestOptions>> batch;
+    batch.reserve(requests.size());
+    for (const auto& [method, arg]: requests) {
+        methodsUtf8.push_back(method.toUtf8());
+        batch.emplace_back(toStringView(methodsUtf8.back()), arg, p->m_id_count++, options);
+    }
+    msgpack::QtTypedArrayScope typedArrays(p->m_protocol.m_remote_typed_arrays);
+    p->m_protocol.sendRequestBatch(batch);
+
+    // Create promises for pending responses
+    for (const auto& request: batch) {
+        const std::uint64_t id = std::get<2>(request);
+        promises.emplace_back([&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+            p->m_pending_responses.insert(id, {std::tuple(resolve, reject), {}});
+        });
+        promises.back().onCancel([peer = QPointer<QRpcPeer>(this), id]() {
+            if (!peer.isNull()) {
+                peer->p->cancelRequest(id);
+            }
+        });
+        p->watchTimeout(id, p->m_default_timeout);
+    }
+    p->m_requests_sent.add(batch.size());
+    p->updateGauges();
+    return promises;
+}
+
+void QRpcPeer::sendEvent(const QString& name, const QVariant& data)
+{
+    // Slow consumers may be configured to miss events
+    if (p->m_buffered_device.dropEvents()) {
         return;
     }
-    std::get<0>(response_iter->second)(o.as<QVariant>());  // Call resolve
-    m_pending_responses.erase(response_iter);
+    const QByteArray nameUtf8 = name.toUtf8();
+    msgpack::QtTypedArrayScope typedArrays(p->m_protocol.m_remote_typed_arrays);
+    p->m_protocol.sendEvent(toStringView(nameUtf8), data);
 }
 
-void QRpcPeer::Private::handleError(std::uint64_t id, const std::string& e) {
-    // Find pending response, ignore response if response ID is unknown
-    auto response_iter = m_pending_responses.find(id);
-    if (response_iter == m_pending_responses.end()) {
+void QRpcPeer::subscribe(const QStringList& patterns)
+{
+    p->m_protocol.sendSubscription(true, patterns);
+}
+
+void QRpcPeer::unsubscribe(const QStringList& patterns)
+{
+    p->m_protocol.sendSubscription(false, patterns);
+}
+
+void QRpcPeer::sendEvent(const QRpcEncodedEvent& event)
+{
+    // Slow consumers may be configured to miss events
+    if (p->m_buffered_device.dropEvents()) {
+        return;
+    }
+    if (event.m_batch && !p->m_protocol.remoteSupports("batch")) {
+        for (const auto& item: event.m_items) {
+            sendEvent(event.m_name, item);
+        }
+        return;
+    }
+    const QByteArray& frame = event.frame();
+    const auto size = static_cast<std::size_t>(frame.size());
+    if (event.m_compressed && p->m_protocol.compresses(size)) {
+        // Compress event once for all peers, the compressed frame keeps the event name as string
+        auto& compressed = *event.m_compressed;
+        std::call_once(compressed.once, [&]() {
+            compressed.smaller = p->m_protocol.compressMessage(frame.constData(), size, compressed.header,
+                                                               compressed.data);
+        });
+        if (compressed.smaller) {
+            p->m_protocol.sendCompressed(size, compressed.header, compressed.data);
+        } else {
+            p->m_protocol.sendIncompressible(frame.constData(), size);
+        }
+        return;
+    }
+    if (p->m_protocol.m_intern_names && event.m_payload_offset > 0) {
+        // Replace event name in front of the serialized event data
+        p->m_protocol.sendEventPayload(toStringView(event.m_name_utf8), frame.constData() + event.m_payload_offset,
+                                       static_cast<std::size_t>(frame.size() - event.m_payload_offset));
         return;
     }
-    std::get<1>(response_iter->second)(std::runtime_error(e));  // Call reject
-    m_pending_responses.erase(response_iter);
+    p->m_protocol.sendFrame(frame.constData(), static_cast<std::size_t>(frame.size()));
 }
 
-void QRpcPeer::Private::handleEvent(const std::string& name, const msgpack::object& o) {
-    QVariant v = o.as<QVariant>();
-    // TODO: force queued connection here?
-    emit b->newEvent(QString::fromStdString(name), v);
+void QRpcPeer::setConcurrencyLimits(int maxInFlight, int maxQueued)
+{
+    p->m_max_processing = std::max(maxInFlight, 0);
+    p->m_max_queued = std::max(maxQueued, 0);
+    p->drainQueue();
 }
 
-void QRpcPeer::Private::cancelPendingResponses()
+void QRpcPeer::setSharedConcurrencyLimit(std::shared_ptr<QRpcConcurrencyLimit> limit)
 {
-    for (const auto& kv: m_pending_responses) {
-        std::get<1>(kv.second)(std::runtime_error("QRpcPeer destroyed before response"));
+    if (p->m_shared_limit) {
+        p->m_shared_limit->removeWaiter(this);
     }
-    m_pending_responses.clear();
+    p->m_shared_limit = std::move(limit);
+    p->drainQueue();
+}
+
+void QRpcPeer::setPauseReadsWhenOverloaded(bool enabled)
+{
+    p->m_pause_reads = enabled;
+    p->updateReadPause();
+}
+
+int QRpcPeer::requestsInFlight() const
+{
+    return p->m_n_processing;
+}
+
+int QRpcPeer::requestsQueued() const
+{
+    return static_cast<int>(p->m_queue.size());
+}
+
+QIODevice* QRpcPeer::device()
+{
+    return p->m_device;
+}
+
+void QRpcPeer::setWriteMode(WriteMode mode)
+{
+    p->m_buffered_device.setCorked(mode == WriteMode::Throughput);
+}
+
+QRpcPeer::WriteMode QRpcPeer::writeMode() const
+{
+    return p->m_buffered_device.isCorked() ? WriteMode::Throughput : WriteMode::LowLatency;
+}
+
+void QRpcPeer::setWriteBufferWatermarks(qint64 low, qint64 high)
+{
+    p->m_buffered_device.m_low_watermark = low;
+    p->m_buffered_device.m_high_watermark = std::max(low, high);
+}
+
+qint64 QRpcPeer::writeBufferLowWatermark() const
+{
+    return p->m_buffered_device.m_low_watermark;
+}
+
+qint64 QRpcPeer::writeBufferHighWatermark() const
+{
+    return p->m_buffered_device.m_high_watermark;
+}
+
+void QRpcPeer::setHandlerRegistry(std::shared_ptr<const QRpcHandlerRegistry> handlers)
+{
+    p->m_handlers = std::move(handlers);
+}
+
+void QRpcPeer::setZeroCopyDecoding(bool enabled)
+{
+    p->m_zero_copy = enabled;
+}
+
+bool QRpcPeer::zeroCopyDecoding() const
+{
+    return p->m_zero_copy;
+}
+
+void QRpcPeer::announceFeatures()
+{
+    p->m_protocol.sendHello(s_features);
+}
+
+void QRpcPeer::setCompressionThreshold(qint64 bytes)
+{
+    p->m_protocol.m_compress_threshold = static_cast<std::size_t>(std::max<qint64>(bytes, 0));
+}
+
+qint64 QRpcPeer::compressionThreshold() const
+{
+    return static_cast<qint64>(p->m_protocol.m_compress_threshold);
+}
+
+QRpcPeerMetrics QRpcPeer::metrics() const
+{
+    QRpcPeerMetrics metrics;
+    metrics.requestsReceived = p->m_requests_received.value();
+    metrics.requestsSent = p->m_requests_sent.value();
+    metrics.bytesReceived = p->m_bytes_received.value();
+    metrics.bytesSent = p->m_buffered_device.m_bytes_written.value();
+    metrics.pendingResponses = p->m_pending_depth.value();
+    metrics.writeBufferBytes = p->m_write_buffer_depth.value();
+    metrics.requestsInFlight = p->m_in_flight_depth.value();
+    metrics.requestsQueued = p->m_queued_depth.value();
+    QReadLocker lock(&p->m_method_stats_lock);
+    for (auto it = p->m_method_stats.cbegin(); it != p->m_method_stats.cend(); ++it) {
+        const QRpcMethodStats& stats = *it.value();
+        metrics.methods.insert(it.key(), {stats.calls.value(), stats.errors.value(), stats.latency.snapshot()});
+    }
+    return metrics;
+}
+
+void QRpcPeer::setReceiveLimits(const QRpcReceiveLimits& limits)
+{
+    p->setReceiveLimits(limits);
+}
+
+QRpcReceiveLimits QRpcPeer::receiveLimits() const
+{
+    return p->m_receive_limits;
+}
+
+void QRpcPeer::setIdleTimeout(std::chrono::milliseconds timeout)
+{
+    if (timeout.count() > 0) {
+        p->m_idle_timer->start(static_cast<int>(timeout.count()));
+    } else {
+        p->m_idle_timer->stop();
+    }
+}
+
+QRpcPeer::CompressionStats QRpcPeer::compressionStats() const
+{
+    CompressionStats stats;
+    stats.compressedMessages = p->m_protocol.m_n_compressed;
+    stats.uncompressedBytes = p->m_protocol.m_bytes_uncompressed;
+    stats.compressedBytes = p->m_protocol.m_bytes_compressed;
+    stats.incompressibleMessages = p->m_protocol.m_n_incompressible;
+    return stats;
+}
+
+qint64 QRpcPeer::bytesToWrite() const
+{
+    return p->m_buffered_device.bytesToWrite();
+}
+
+bool QRpcPeer::isWriteBufferFull() const
+{
+    return p->m_buffered_device.isFull();
+}
+
+void QRpcPeer::setSlowConsumerPolicy(SlowConsumerPolicy policy)
+{
+    p->m_buffered_device.m_policy = policy;
+}
+
+QRpcPeer::SlowConsumerPolicy QRpcPeer::slowConsumerPolicy() const
+{
+    return p->m_buffered_device.m_policy;
+}
+
+void QRpcPeer::Private::readAvailableBytes()
+{
+    // Leave data in the device while requests are queued or the write buffer is full
+    if (m_read_paused) {
+        return;
+    }
+    // Handlers may run nested event loops processing incoming data, don't re-enter the decoder in this case
+    if (m_reading) {
+        m_read_again = true;
+        return;
+    }
+    m_reading = true;
+    try {
+        do {
+            m_read_again = false;
+            // The protocol reads all available bytes
+            const qint64 n_avail = std::max<qint64>(m_device->bytesAvailable(), 0);
+            m_bytes_received.add(static_cast<quint64>(n_avail));
+            QRPC_TRACE(BytesRead, b, 0, QStringView(), n_avail);
+            m_protocol.readAvailableBytes();
+        } while (m_read_again);
+    } catch (const std::runtime_error& e) {
+        // Close stream on error
+        qWarning() << "QRpcPeer:" << e.what();
+        m_device->close();
+    }
+    m_reading = false;
+    updateGauges();
+}
+
+void QRpcPeer::Private::setReceiveLimits(const QRpcReceiveLimits& limits)
+{
+    m_receive_limits = limits;
+    // Strings and binary data cannot exceed the message size, neither can the items allocated for a container
+    const std::size_t n_max = limits.maxMessageSize;
+    const std::size_t n_array = std::min(limits.maxArrayLength, n_max / sizeof(msgpack::object));
+    const std::size_t n_map = std::min(limits.maxMapLength, n_max / sizeof(msgpack::object_kv));
+    m_protocol.setReceiveLimits(n_max, msgpack::unpack_limit(n_array, n_map, n_max, n_max, n_max, limits.maxDepth));
+}
+
+msgpack::QtZeroCopyScope::Retain QRpcPeer::Private::zeroCopyRetain() const
+{
+    if (!m_zero_copy) {
+        return {};
+    }
+    // The message is only retained by values referencing it, its zone is reused otherwise
+    return [this]() -> std::shared_ptr<const void> {
+        return m_protocol.retainMessage();
+    };
+}
+
+std::shared_ptr<QRpcMethodStats> QRpcPeer::Private::methodStats(const QString& method)
+{
+    {
+        QReadLocker lock(&m_method_stats_lock);
+        if (auto stats = m_method_stats.value(method)) {
+            return stats;
+        }
+    }
+    // Only this thread adds methods, no need to look up the method again
+    QWriteLocker lock(&m_method_stats_lock);
+    const QString key = (m_method_stats.size() < s_max_method_stats) ? method : QStringLiteral("<other>");
+    auto& stats = m_method_stats[key];
+    if (!stats) {
+        stats = std::make_shared<QRpcMethodStats>();
+    }
+    return stats;
+}
+
+void QRpcPeer::Private::recordLatency(QRpcMethodStats& stats, Clock::time_point start)
+{
+    const auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - start);
+    stats.latency.record(static_cast<quint64>(std::max<std::int64_t>(elapsed.count(), 0)));
+}
+
+void QRpcPeer::Private::updateGauges()
+{
+    m_pending_depth.set(m_pending_responses.size());
+    m_write_buffer_depth.set(static_cast<quint64>(m_buffered_device.bytesToWrite()));
+    m_in_flight_depth.set(static_cast<quint64>(m_n_processing));
+    m_queued_depth.set(m_queue.size());
+}
+
+void QRpcPeer::Private::handleRequest(std::string_view method, const msgpack::object& o, std::uint64_t id,
+                                      const MsgpackRpcMessage::RequestOptions& options)
+{
+    // Zero-copy values share ownership of the received message, retained by the first large binary value
+    msgpack::QtZeroCopyScope zeroCopy(zeroCopyRetain(), m_protocol.referenceThreshold());
+    const auto start = Clock::now();
+    const QString methodName = fromUtf8(method);
+    auto stats = methodStats(methodName);
+    stats->calls.add();
+    m_requests_received.add();
+    const QDeadlineTimer deadline = (options.timeout >= 0) ? QDeadlineTimer(options.timeout)
+                                                           : QDeadlineTimer(QDeadlineTimer::Forever);
+
+    // Typed handlers decode arguments themselves and answer the request directly
+    auto handler = m_handlers ? m_handlers->find(methodName) : nullptr;
+
+    // Track request until it is answered, the client may cancel it in the meantime
+    QueuedRequest request{methodName, handler ? QVariant() : o.as<QVariant>(), id,
+                          QRpcRequestContext(deadline, true, b, id), newReply(), options.stream, stats, start,
+                          handler, handler ? &o : nullptr};
+    m_in_flight.emplace(id, request.context);
+    QRPC_TRACE(Decoded, b, id, methodName, 0);
+
+    // Process request now or queue it if the concurrency limit is reached
+    std::shared_ptr<QRpcConcurrencyLimit> sharedLimit;
+    if (acquireSlot(sharedLimit)) {
+        processRequest(std::move(request), std::move(sharedLimit));
+        return;
+    }
+    if (m_queue.size() >= static_cast<std::size_t>(m_max_queued)) {
+        m_in_flight.erase(id);
+        sendError(request.reply, id, "Server overloaded");
+        stats->errors.add();
+        recordLatency(*stats, start);
+        return;
+    }
+    if (handler) {
+        request.message = m_protocol.retainMessage();
+    }
+    m_queue.push_back(std::move(request));
+    drainQueue();
+}
+
+void QRpcPeer::Private::processRequest(QueuedRequest request, std::shared_ptr<QRpcConcurrencyLimit> sharedLimit)
+{
+    if (request.handler) {
+        invokeHandler(std::move(request), std::move(sharedLimit));
+        return;
+    }
+    QPointer<QRpcPeer> peer(b);
+    auto finish = [peer, sharedLimit]() {
+        // Release slot of concurrency limit, even if the peer is gone
+        if (sharedLimit) {
+            sharedLimit->release();
+        }
+        if (!peer.isNull()) {
+            --peer->p->m_n_processing;
+            peer->p->drainQueue();
+        }
+    };
+    const auto id = request.id;
+    auto p = QRpcPromise([&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+        // Emit signal for new request, forwarding resolvers
+        QRPC_TRACE(RequestEmitted, b, id, request.method, 0);
+        emit b->newRequest(request.method, request.args, resolve, reject, request.context);
+    }).then([peer, id, reply = request.reply, context = request.context, finish,
+              streamCredit = request.streamCredit, stats = request.stats, start = request.start](const QVariant& result) {
+        // Send reply once resolved, latency includes packing the reply into the write buffer
+        QRPC_TRACE(Resolved, peer.data(), id, QStringView(), 0);
+        if (!peer.isNull()) {
+            peer->p->sendResult(reply, id, result, streamCredit, context, finish);
+        } else {
+            finish();
+        }
+        recordLatency(*stats, start);
+    }).fail([peer, id, reply = request.reply, context = request.context, finish,
+             stats = request.stats, start = request.start](const std::exception& e) {
+        // Send error if request was rejected
+        QRPC_TRACE(Resolved, peer.data(), id, QStringView(), 0);
+        if (!peer.isNull() && peer->p->finishInFlight(id, reply, context)) {
+            peer->p->sendError(reply, id, e.what());
+        }
+        stats->errors.add();
+        recordLatency(*stats, start);
+        finish();
+    });
+}
+
+void QRpcPeer::Private::invokeHandler(QueuedRequest request, std::shared_ptr<QRpcConcurrencyLimit> sharedLimit)
+{
+    const auto id = request.id;
+    // Typed handlers answer synchronously, requests canceled while queued are not invoked
+    if (finishInFlight(id, request.reply, request.context)) {
+        Response response(*this, id, request.reply);
+        if (request.context.isExpired()) {
+            response.reject("Request deadline exceeded");
+        } else {
+            std::optional<msgpack::QtZeroCopyScope> zeroCopy;
+            if (m_zero_copy && request.message) {
+                zeroCopy.emplace([message = request.message]() -> std::shared_ptr<const void> {
+                    return message;
+                }, m_protocol.referenceThreshold());
+            }
+            QRpcRequestContext::Scope scope(request.context);
+            QRPC_TRACE(MethodInvoked, b, id, request.method, 0);
+            msgpack::QtTypedArrayScope typedArrays(m_protocol.m_remote_typed_arrays);
+            (*request.handler)(*request.handlerArgs, response);
+        }
+        if (response.failed()) {
+            request.stats->errors.add();
+        }
+    }
+    recordLatency(*request.stats, request.start);
+    // Release the slot right away, the caller continues with queued requests
+    if (sharedLimit) {
+        sharedLimit->release();
+    }
+    --m_n_processing;
+}
+
+bool QRpcPeer::Private::acquireSlot(std::shared_ptr<QRpcConcurrencyLimit>& sharedLimit)
+{
+    // Queued requests are processed first
+    if (!m_queue.empty() || (m_max_processing > 0 && m_n_processing >= m_max_processing)) {
+        return false;
+    }
+    if (m_shared_limit && !m_shared_limit->tryAcquire()) {
+        return false;
+    }
+    sharedLimit = m_shared_limit;
+    ++m_n_processing;
+    return true;
+}
+
+void QRpcPeer::Private::drainQueue()
+{
+    while (!m_queue.empty()) {
+        if (m_max_processing > 0 && m_n_processing >= m_max_processing) {
+            break;
+        }
+        if (m_shared_limit && !m_shared_limit->tryAcquire()) {
+            // Wait for a slot released by any peer, it may have been released before waiting
+            m_shared_limit->addWaiter(b, [this]() { drainQueue(); });
+            if (!m_shared_limit->tryAcquire()) {
+                break;
+            }
+        }
+        ++m_n_processing;
+        QueuedRequest request = std::move(m_queue.front());
+        m_queue.pop_front();
+        processRequest(std::move(request), m_shared_limit);
+    }
+    updateGauges();
+    updateReadPause();
+}
+
+void QRpcPeer::Private::updateReadPause()
+{
+    const bool pause = (m_pause_reads && !m_queue.empty()) ||
+                       (m_buffered_device.m_policy == QRpcPeer::SlowConsumerPolicy::Block &&
+                        m_buffered_device.isFull());
+    if (pause == m_read_paused) {
+        return;
+    }
+    m_read_paused = pause;
+    // Stop dispatching messages already received, the protocol resumes with them once unpaused
+    m_protocol.m_paused = pause;
+    // Limit socket buffer while paused, stopping to receive once it is full
+    if (auto* socket = qobject_cast<QAbstractSocket*>(m_device)) {
+        if (pause) {
+            m_read_buffer_size = socket->readBufferSize();
+            socket->setReadBufferSize(s_paused_read_buffer_size);
+        } else {
+            socket->setReadBufferSize(m_read_buffer_size);
+        }
+    }
+    // Data may have arrived while paused without further notification
+    if (!pause) {
+        QMetaObject::invokeMethod(b, [this]() { readAvailableBytes(); }, Qt::QueuedConnection);
+    }
+}
+
+bool QRpcPeer::Private::finishInFlight(std::uint64_t id, const BatchReply& reply, const QRpcRequestContext& context)
+{
+    m_in_flight.erase(id);
+    if (!context.isCanceled()) {
+        return true;
+    }
+    // Client does not wait for canceled requests, only batches need a reply for each request
+    if (reply.buffer) {
+        sendError(reply, id, "Request canceled");
+    }
+    return false;
+}
+
+void QRpcPeer::Private::sendResult(const BatchReply& reply, std::uint64_t id, const QVariant& result,
+                                   std::int64_t streamCredit, const QRpcRequestContext& context,
+                                   std::function<void()> finish)
+{
+    if (result.metaType() != QMetaType::fromType<QRpcStreamGenerator>()) {
+        if (finishInFlight(id, reply, context)) {
+            sendResponse(reply, id, result);
+        }
+        finish();
+        return;
+    }
+    const auto generator = result.value<QRpcStreamGenerator>();
+    // Stream items if requested by the client, the stream keeps the request slot until it ended
+    if (streamCredit >= 0 && !reply.buffer) {
+        m_out_streams.emplace(id, OutStream{generator, streamCredit, context, std::move(finish)});
+        pumpStream(id);
+        return;
+    }
+    // Batches and other clients receive the items at once, reject streams too long for a single response
+    QVariantList items;
+    try {
+        while (auto item = generator.next()) {
+            if (items.size() >= s_max_collected_items) {
+                throw std::runtime_error("Too many items, request result as stream");
+            }
+            // Stop pulling items nobody waits for anymore
+            if (context.isCanceled() || context.isExpired()) {
+                throw std::runtime_error("Request deadline exceeded");
+            }
+            items.append(std::move(*item));
+        }
+    } catch (const std::exception& e) {
+        if (finishInFlight(id, reply, context)) {
+            sendError(reply, id, e.what());
+        }
+        finish();
+        return;
+    }
+    if (finishInFlight(id, reply, context)) {
+        sendResponse(reply, id, items);
+    }
+    finish();
+}
+
+QRpcPeer::Private::OutStream QRpcPeer::Private::takeStream(std::map<std::uint64_t, OutStream>::iterator stream_iter)
+{
+    OutStream stream = std::move(stream_iter->second);
+    m_out_streams.erase(stream_iter);
+    return stream;
+}
+
+void QRpcPeer::Private::pumpStream(std::uint64_t id)
+{
+    auto stream_iter = m_out_streams.find(id);
+    if (stream_iter == m_out_streams.end()) {
+        return;
+    }
+    OutStream& stream = stream_iter->second;
+    const BatchReply reply;
+    if (stream.context.isExpired()) {
+        const OutStream ended = takeStream(stream_iter);
+        if (finishInFlight(id, reply, ended.context)) {
+            sendError(reply, id, "Request deadline exceeded");
+        }
+        ended.finish();
+        return;
+    }
+    // Produce items while the client accepts them and the write buffer has room
+    QVariantList items;
+    auto sendItems = [&]() {
+        if (!items.isEmpty()) {
+            msgpack::QtTypedArrayScope typedArrays(m_protocol.m_remote_typed_arrays);
+            m_protocol.sendStreamItems(id, items);
+            items.clear();
+        }
+    };
+    while (stream.credit > 0 && !m_buffered_device.isFull()) {
+        std::optional<QVariant> item;
+        try {
+            item = stream.generator.next();
+        } catch (const std::exception& e) {
+            sendItems();
+            const OutStream ended = takeStream(stream_iter);
+            if (finishInFlight(id, reply, ended.context)) {
+                sendError(reply, id, e.what());
+            }
+            ended.finish();
+            return;
+        }
+        if (!item) {
+            // End stream with an empty response
+            sendItems();
+            const OutStream ended = takeStream(stream_iter);
+            if (finishInFlight(id, reply, ended.context)) {
+                sendResponse(reply, id, QVariant());
+            }
+            ended.finish();
+            return;
+        }
+        items.append(std::move(*item));
+        --stream.credit;
+        if (items.size() >= s_stream_chunk_items) {
+            sendItems();
+        }
+    }
+    sendItems();
+}
+
+void QRpcPeer::Private::handleStreamCredit(std::uint64_t id, std::uint64_t n)
+{
+    auto stream_iter = m_out_streams.find(id);
+    if (stream_iter == m_out_streams.end()) {
+        return;
+    }
+    stream_iter->second.credit += static_cast<std::int64_t>(std::min<std::uint64_t>(n, INT32_MAX));
+    pumpStream(id);
+}
+
+void QRpcPeer::Private::pumpBlobs()
+{
+    // Send chunks while the write buffer has room, resumed once it drained
+    while (!m_out_blobs.empty() && !m_buffered_device.isFull()) {
+        OutBlob& blob = m_out_blobs.front();
+        if (blob.file.isNull() || !blob.file->isOpen()) {
+            // Closing the file released the mapping
+            m_protocol.sendBlobEnd(blob.id, "File closed by sender");
+            const auto reject = blob.reject;
+            m_out_blobs.pop_front();
+            reject(std::runtime_error("File closed before it was sent"));
+            continue;
+        }
+        if (blob.offset < blob.size) {
+            const qint64 n = std::min(blob.size - blob.offset, s_blob_chunk_size);
+            m_protocol.sendBlobChunk(blob.id, reinterpret_cast<const char*>(blob.data + blob.offset),
+                                     static_cast<std::size_t>(n));
+            blob.offset += n;
+            continue;
+        }
+        m_protocol.sendBlobEnd(blob.id);
+        if (blob.data) {
+            blob.file->unmap(const_cast<uchar*>(blob.data));
+        }
+        const auto resolve = blob.resolve;
+        m_out_blobs.pop_front();
+        resolve(QVariant());
+    }
+}
+
+void QRpcPeer::Private::handleBlobBegin(std::uint64_t id, std::string_view name, std::uint64_t size)
+{
+    InBlob blob{fromUtf8(name), nullptr, {}};
+    if (m_blob_sink_factory) {
+        blob.sink = m_blob_sink_factory(blob.name, static_cast<qint64>(size));
+    }
+    m_in_blobs.insert_or_assign(id, std::move(blob));
+}
+
+void QRpcPeer::Private::handleBlobChunk(std::uint64_t id, const char* data, std::size_t size)
+{
+    auto blob_iter = m_in_blobs.find(id);
+    if (blob_iter == m_in_blobs.end()) {
+        return;
+    }
+    // Write chunk from the receive buffer to the sink, keep first error
+    InBlob& blob = blob_iter->second;
+    if (blob.sink.isNull() || !blob.error.isEmpty()) {
+        return;
+    }
+    if (blob.sink->write(data, static_cast<qint64>(size)) != static_cast<qint64>(size)) {
+        blob.error = blob.sink->errorString();
+    }
+}
+
+void QRpcPeer::Private::handleBlobEnd(std::uint64_t id, std::string_view error)
+{
+    auto blob_iter = m_in_blobs.find(id);
+    if (blob_iter == m_in_blobs.end()) {
+        return;
+    }
+    InBlob blob = std::move(blob_iter->second);
+    m_in_blobs.erase(blob_iter);
+    if (!error.empty()) {
+        blob.error = fromUtf8(error);
+    }
+    emit b->blobReceived(blob.name, blob.sink, blob.error);
+}
+
+void QRpcPeer::Private::handleStreamItems(std::uint64_t id, const msgpack::object& items)
+{
+    auto reader_iter = m_in_streams.find(id);
+    if (reader_iter == m_in_streams.end() || reader_iter->second.isNull()) {
+        return;
+    }
+    QRpcStreamReader* reader = reader_iter->second;
+    for (std::uint32_t i = 0; i < items.via.array.size; ++i) {
+        reader->m_items.append(items.via.array.ptr[i].as<QVariant>());
+    }
+    emit reader->readyRead();
+}
+
+void QRpcPeer::Private::handleCancel(std::uint64_t id)
+{
+    // Canceled streams stop pulling items and release their slot
+    std::function<void()> finishStream;
+    if (auto stream_iter = m_out_streams.find(id); stream_iter != m_out_streams.end()) {
+        finishStream = takeStream(stream_iter).finish;
+    }
+    auto request_iter = m_in_flight.find(id);
+    if (request_iter != m_in_flight.end()) {
+        const QRpcRequestContext context = request_iter->second;
+        m_in_flight.erase(request_iter);
+        context.cancel();
+    }
+    if (finishStream) {
+        finishStream();
+    }
+}
+
+void QRpcPeer::Private::handleResponse(std::uint64_t id, const msgpack::object& o) {
+    // Find pending response, ignore response if response ID is unknown
+    const auto pending = m_pending_responses.take(id);
+    if (!pending) {
+        return;
+    }
+    // Response values are handed to promise continuations, always decode a deep copy
+    pending->resolve(o.as<QVariant>());
+}
+
+void QRpcPeer::Private::handleError(std::uint64_t id, std::string_view e) {
+    // Find pending response, ignore response if response ID is unknown
+    const auto pending = m_pending_responses.take(id);
+    if (!pending) {
+        return;
+    }
+    pending->reject(fromUtf8(e));
+}
+
+void QRpcPeer::Private::handleEvent(std::string_view name, const msgpack::object& o) {
+    msgpack::QtZeroCopyScope zeroCopy(zeroCopyRetain(), m_protocol.referenceThreshold());
+    QVariant v = o.as<QVariant>();
+    // TODO: force queued connection here?
+    emit b->newEvent(fromUtf8(name), v);
+}
+
+void QRpcPeer::Private::handleEventBatch(std::string_view name, const msgpack::object& items) {
+    msgpack::QtZeroCopyScope zeroCopy(zeroCopyRetain(), m_protocol.referenceThreshold());
+    const QString eventName = fromUtf8(name);
+    for (std::uint32_t i = 0; i < items.via.array.size; ++i) {
+        emit b->newEvent(eventName, items.via.array.ptr[i].as<QVariant>());
+    }
+}
+
+void QRpcPeer::Private::handleHello()
+{
+    // Features are only announced to peers known to understand the announcement
+    if (!m_protocol.m_hello_sent) {
+        m_protocol.sendHello(s_features);
+    }
+}
+
+void QRpcPeer::Private::handleSubscription(bool subscribe, const msgpack::object& patterns)
+{
+    for (std::uint32_t i = 0; i < patterns.via.array.size; ++i) {
+        const auto pattern = patterns.via.array.ptr[i].as<QString>();
+        if (subscribe && !m_subscriptions.contains(pattern)) {
+            m_subscriptions.append(pattern);
+        } else if (!subscribe) {
+            m_subscriptions.removeAll(pattern);
+        }
+    }
+    emit b->subscriptionsChanged(m_subscriptions);
+}
+
+void QRpcPeer::Private::beginBatch()
+{
+    m_batch = std::make_shared<Batch>();
+}
+
+void QRpcPeer::Private::endBatch()
+{
+    auto batch = std::move(m_batch);
+    m_batch = nullptr;
+    batch->complete = true;
+    if (batch->replies.empty()) {
+        return;
+    }
+    // Send replies now if all requests finished synchronously
+    if (batch->n_finished == batch->replies.size()) {
+        flushBatch(*batch);
+        return;
+    }
+    // Don't let slow requests hold back the replies of faster ones
+    QTimer::singleShot(s_batch_reply_deadline, b, [this, weak = std::weak_ptr<Batch>(batch)]() {
+        if (auto batch = weak.lock()) {
+            flushBatch(*batch);
+        }
+    });
+}
+
+QRpcPeer::Private::BatchReply QRpcPeer::Private::newReply()
+{
+    if (!m_batch) {
+        return {};
+    }
+    m_batch->finished.push_back(false);
+    return {m_batch, &m_batch->replies.emplace_back(), m_batch->replies.size() - 1};
+}
+
+void QRpcPeer::Private::finishReply(const BatchReply& reply)
+{
+    Batch& batch = *reply.batch;
+    ++batch.n_finished;
+    if (batch.flushed) {
+        // Batch deadline passed, send reply on its own
+        m_protocol.sendFrame(reply.buffer->data(), reply.buffer->size());
+        return;
+    }
+    batch.finished[reply.index] = true;
+    if (batch.n_finished == batch.replies.size() && batch.complete) {
+        flushBatch(batch);
+    }
+}
+
+void QRpcPeer::Private::flushBatch(Batch& batch)
+{
+    if (batch.flushed) {
+        return;
+    }
+    batch.flushed = true;
+    std::vector<std::string_view> replies;
+    replies.reserve(batch.n_finished);
+    for (std::size_t i = 0; i < batch.replies.size(); ++i) {
+        if (batch.finished[i]) {
+            replies.emplace_back(batch.replies[i].data(), batch.replies[i].size());
+        }
+    }
+    if (!replies.empty()) {
+        m_protocol.sendBatch(replies);
+    }
+}
+
+void QRpcPeer::Private::sendResponse(const BatchReply& reply, std::uint64_t id, const QVariant& result)
+{
+    msgpack::QtTypedArrayScope typedArrays(m_protocol.m_remote_typed_arrays);
+    if (!reply.buffer) {
+        m_protocol.sendResponse(id, result);
+    } else {
+        msgpack::packer<msgpack::sbuffer> packer(*reply.buffer);
+        MsgpackRpcMessage::packResponseHeader(packer, id);
+        packer.pack(result);
+        finishReply(reply);
+    }
+    QRPC_TRACE(ResponsePacked, b, id, QStringView(), 0);
+}
+
+void QRpcPeer::Private::sendError(const BatchReply& reply, std::uint64_t id, std::string_view error)
+{
+    if (!reply.buffer) {
+        m_protocol.sendError(id, error);
+    } else {
+        msgpack::packer<msgpack::sbuffer> packer(*reply.buffer);
+        MsgpackRpcMessage::packError(packer, id, error);
+        finishReply(reply);
+    }
+    QRPC_TRACE(ResponsePacked, b, id, QStringView(), 0);
+}
+
+void QRpcPeer::Private::watchTimeout(std::uint64_t id, std::chrono::milliseconds timeout)
+{
+    if (timeout.count() <= 0) {
+        return;
+    }
+    m_timeouts.insert(id, QDeadlineTimer::current().deadline() + timeout.count());
+    if (!m_timeout_timer->isActive()) {
+        m_timeout_timer->start();
+    }
+}
+
+void QRpcPeer::Private::cancelRequest(std::uint64_t id)
+{
+    const auto pending = m_pending_responses.take(id);
+    if (!pending) {
+        return;
+    }
+    m_protocol.sendCancel(id);
+    if (pending->resolvers) {
+        std::get<1>(*pending->resolvers)(QtPromise::QPromiseCanceledException());
+    } else {
+        pending->reject("Request canceled");
+    }
+    updateGauges();
+}
+
+void QRpcPeer::Private::expireRequests()
+{
+    m_timeouts.advance(QDeadlineTimer::current().deadline(), [this](std::uint64_t id) {
+        // Requests answered in time are no longer pending
+        const auto pending = m_pending_responses.take(id);
+        if (!pending) {
+            return;
+        }
+        pending->reject("Request timed out");
+    });
+    if (m_timeouts.isEmpty() || m_pending_responses.empty()) {
+        m_timeout_timer->stop();
+    }
+    updateGauges();
+}
+
+void QRpcPeer::Private::cancelPendingResponses()
+{
+    for (const auto& blob: m_out_blobs) {
+        if (blob.data && !blob.file.isNull()) {
+            blob.file->unmap(const_cast<uchar*>(blob.data));
+        }
+        blob.reject(std::runtime_error("QRpcPeer destroyed before file was sent"));
+    }
+    m_out_blobs.clear();
+    for (const auto& pending: m_pending_responses.takeAll()) {
+        pending.reject("QRpcPeer destroyed before response");
+    }
+}
+
+QRpcStreamReader::QRpcStreamReader(QRpcPeer* peer, std::uint64_t id, QRpcPromise result)
+    : m_peer(peer)
+    , m_id(id)
+    , m_result(std::move(result))
+{
+    // Items of a stream are received before its end, finish once the response arrived
+    m_result.finally([reader = QPointer<QRpcStreamReader>(this)]() {
+        if (reader.isNull()) {
+            return;
+        }
+        reader->m_finished = true;
+        if (!reader->m_peer.isNull()) {
+            reader->m_peer->p->m_in_streams.erase(reader->m_id);
+        }
+        emit reader->finished();
+    });
+}
+
+QRpcStreamReader::~QRpcStreamReader()
+{
+    if (m_finished || m_peer.isNull()) {
+        return;
+    }
+    // Stop remote peer from producing items nobody reads
+    m_peer->p->m_in_streams.erase(m_id);
+    m_result.cancel();
+}
+
+QVariantList QRpcStreamReader::read(qsizetype maxItems)
+{
+    const qsizetype n = (maxItems < 0) ? m_items.size() : std::min(maxItems, m_items.size());
+    QVariantList items = m_items.mid(0, n);
+    m_items.remove(0, n);
+    // Grant credit for the items taken from the stream
+    if (n > 0 && !m_finished && !m_peer.isNull()) {
+        m_peer->p->m_protocol.sendStreamCredit(m_id, static_cast<std::uint64_t>(n));
+    }
+    return items;
+}
+
+struct QRpcRequestContext::CancelState
+{
+    std::atomic<bool> canceled{false};
+    QMutex mutex;
+    std::vector<std::pair<QPointer<QObject>, std::function<void()>>> callbacks;
+};
+
+QRpcRequestContext::QRpcRequestContext(QDeadlineTimer deadline, bool cancelable,
+                                       const QRpcPeer* peer, std::uint64_t requestId)
+    : m_deadline(deadline)
+    , m_cancel(cancelable ? std::make_shared<CancelState>() : nullptr)
+    , m_peer(peer)
+    , m_request_id(requestId)
+{ }
+
+bool QRpcRequestContext::isCanceled() const
+{
+    return m_cancel && m_cancel->canceled.load();
+}
+
+void QRpcRequestContext::onCanceled(QObject* receiver, std::function<void()> f) const
+{
+    if (!m_cancel) {
+        return;
+    }
+    {
+        QMutexLocker locker(&m_cancel->mutex);
+        if (!m_cancel->canceled.load()) {
+            m_cancel->callbacks.emplace_back(receiver, std::move(f));
+            return;
+        }
+    }
+    if (receiver) {
+        QMetaObject::invokeMethod(receiver, std::move(f));
+    }
+}
+
+void QRpcRequestContext::cancel() const
+{
+    if (!m_cancel) {
+        return;
+    }
+    decltype(m_cancel->callbacks) callbacks;
+    {
+        QMutexLocker locker(&m_cancel->mutex);
+        if (m_cancel->canceled.exchange(true)) {
+            return;
+        }
+        callbacks.swap(m_cancel->callbacks);
+    }
+    for (auto& [receiver, f]: callbacks) {
+        if (!receiver.isNull()) {
+            QMetaObject::invokeMethod(receiver.data(), std::move(f));
+        }
+    }
+}
+
+QRpcRequestContext QRpcRequestContext::current()
+{
+    return t_current_request ? *t_current_request : QRpcRequestContext();
+}
+
+QRpcRequestContext::Scope::Scope(const QRpcRequestContext& context)
+    : m_previous(t_current_request)
+{
+    t_current_request = &context;
+}
+
+QRpcRequestContext::Scope::~Scope()
+{
+    t_current_request = m_previous;
+}
+
+QRpcEncodedEvent::QRpcEncodedEvent(const QString& name, const QVariant& data)
+    : m_name(name)
+    , m_name_utf8(name.toUtf8())
+{
+    msgpack::QByteArrayBuffer buffer;
+    msgpack::packer<msgpack::QByteArrayBuffer> packer(buffer);
+    MsgpackRpcMessage::packEventHeader(packer, toStringView(m_name_utf8));
+    m_payload_offset = static_cast<QByteArray&>(buffer).size();
+    packer.pack(data);
+    m_frame = std::move(static_cast<QByteArray&>(buffer));
+    if (m_frame.size() >= s_shared_compression_size) {
+        m_compressed = std::make_shared<CompressedFrame>();
+    }
+}
+
+QRpcEncodedEvent QRpcEncodedEvent::batch(const QString& name, const QVariantList& items)
+{
+    QRpcEncodedEvent event;
+    event.m_name = name;
+    event.m_items = items;
+    event.m_batch = true;
+    msgpack::QByteArrayBuffer buffer;
+    msgpack::packer<msgpack::QByteArrayBuffer> packer(buffer);
+    const QByteArray nameUtf8 = name.toUtf8();
+    MsgpackRpcMessage::packEventBatch(packer, toStringView(nameUtf8), items);
+    event.m_frame = std::move(static_cast<QByteArray&>(buffer));
+    if (event.m_frame.size() >= s_shared_compression_size) {
+        event.m_compressed = std::make_shared<CompressedFrame>();
+    }
+    return event;
+}
+
+void QRpcConcurrencyLimit::release()
+{
+    m_in_flight.fetch_sub(1, std::memory_order_relaxed);
+    // Wake up all waiting peers, peers not getting a slot wait again
+    QMutexLocker locker(&m_mutex);
+    for (auto& [peer, wake]: m_waiters) {
+        QMetaObject::invokeMethod(peer, std::move(wake), Qt::QueuedConnection);
+    }
+    m_waiters.clear();
+}
+
+void QRpcConcurrencyLimit::addWaiter(QObject* peer, std::function<void()> wake)
+{
+    QMutexLocker locker(&m_mutex);
+    for (const auto& waiter: m_waiters) {
+        if (waiter.first == peer) {
+            return;
+        }
+    }
+    m_waiters.emplace_back(peer, std::move(wake));
+}
+
+void QRpcConcurrencyLimit::removeWaiter(QObject* peer)
+{
+    QMutexLocker locker(&m_mutex);
+    m_waiters.erase(std::remove_if(m_waiters.begin(), m_waiters.end(), [peer](const auto& waiter) {
+        return waiter.first == peer;
+    }), m_waiters.end());
 }
 
 void QRpcPromise::_compilerGuide_()
@@ -1,134 +1,690 @@
 #include <QRpcService.hpp>
 #include <QRpcPeer.hpp>
+#include "Tracing.hpp"
 #include <QTcpSocket>
 #include <QMetaObject>
 #include <QMetaMethod>
+#include <QVarLengthArray>
+#include <QPointer>
+#include <QSet>
+#include <QThreadPool>
+#include <algorithm>
+#include <functional>
+#include <iterator>
+#include <memory>
 
 
-// Call QMetaMethod with conversion from QVariant (based on https://gist.github.com/andref/2838534)
-QVariant invokeAutoConvert(QObject* object, const QMetaMethod& metaMethod, const QVariantList& args)
+/**
+ * Dispatch information compiled for a registered method once at registration time.
+ */
+struct QRpcServiceBase::RpcMethod
 {
+    enum class ArgPlan {
+        Variant,  // Parameter is QVariant, pass argument as is
+        Double,   // Convert to double, with fallback for types QVariant refuses to convert
+        Convert,  // Convert to parameter type if argument type differs
+    };
+    enum class ReturnPlan {
+        Ignore,   // Void or unknown return type
+        Variant,  // Method returns QVariant, write directly to return value
+        Typed,    // Method returns known metatype, write to QVariant of that type
+    };
+
+    RpcMethod(QObject* o, const QMetaMethod& mm)
+        : object(o)
+        , method(mm)
+        , methodIndex(mm.methodIndex())
+    {
+        for (int i = 0; i < mm.parameterCount(); ++i) {
+            const auto paramType = mm.parameterMetaType(i);
+            paramTypes.append(paramType);
+            if (paramType.id() == QMetaType::QVariant) {
+                argPlans.append(ArgPlan::Variant);
+            } else if (paramType.id() == QMetaType::Double) {
+                argPlans.append(ArgPlan::Double);
+            } else {
+                argPlans.append(ArgPlan::Convert);
+            }
+        }
+        returnType = mm.returnMetaType();
+        switch (returnType.id()) {
+        case QMetaType::UnknownType:
+        case QMetaType::Void:
+            returnPlan = ReturnPlan::Ignore;
+            break;
+        case QMetaType::QVariant:
+            returnPlan = ReturnPlan::Variant;
+            break;
+        default:
+            returnPlan = ReturnPlan::Typed;
+            break;
+        }
+    }
+
+    QPointer<QObject> object;  // Null once the registered object was destroyed
+    QMetaMethod method;
+    int methodIndex;
+    QList<QMetaType> paramTypes;
+    QList<ArgPlan> argPlans;
+    QMetaType returnType;
+    ReturnPlan returnPlan;
+    bool threadPool = false;  // Invoke in global thread pool instead of the object thread
+};
+
+
+// Convert argument copy to parameter type (based on https://gist.github.com/andref/2838534)
+static bool convertArgument(QVariant& copy, QMetaType paramType, QRpcServiceBase::RpcMethod::ArgPlan plan)
+{
+    if (!copy.canConvert(paramType)) {
+        // Special treatment for ->double conversion (e.g. long to double not allowed)
+        if (plan != QRpcServiceBase::RpcMethod::ArgPlan::Double) {
+            qWarning() << "Cannot convert" << copy.typeName() << "to" << paramType.name();
+            return false;
+        }
+        bool ok;
+        copy = copy.toDouble(&ok);
+        if (!ok) {
+            qWarning() << "Cannot convert" << copy.typeName() << "to" << paramType.name();
+            return false;
+        }
+    }
+    if (!copy.convert(paramType)) {
+        qWarning() << "Error converting" << copy.typeName() << "to" << paramType.name();
+        return false;
+    }
+    return true;
+}
+
+// Call compiled method with conversion from QVariant
+QVariant invokeAutoConvert(const QRpcServiceBase::RpcMethod& m, const QVariantList& args)
+{
+    using ArgPlan = QRpcServiceBase::RpcMethod::ArgPlan;
+    using ReturnPlan = QRpcServiceBase::RpcMethod::ReturnPlan;
+
     // Check if number of incoming args is sufficient or larger
-    if (metaMethod.parameterCount() > args.size()) {
-        qWarning() << "Insufficient arguments to call" << metaMethod.methodSignature();
+    const auto n_params = m.paramTypes.size();
+    if (n_params > args.size()) {
+        qWarning() << "Insufficient arguments to call" << m.method.methodSignature();
         return {};
     }
 
-    // Make a copy of incoming args and convert them to target types
-    QVariantList converted;
-    for (int i = 0; i < metaMethod.parameterCount(); i++) {
+    // Build argument vector, converting copies of arguments not matching the parameter type
+    QVarLengthArray<QVariant, 8> converted(n_params);
+    QVarLengthArray<void*, 9> argv(n_params + 1);
+    for (qsizetype i = 0; i < n_params; ++i) {
         const QVariant& arg = args.at(i);
-        auto copy = QVariant{arg};
-        const auto paramType = metaMethod.parameterMetaType(i);
-        const auto argType = copy.metaType();
-        bool paramIsVariant = (paramType.id() == QMetaType::QVariant);
-        bool needConversion = !paramIsVariant && (argType != paramType);
-        if (needConversion) {
-            if (!copy.canConvert(paramType)) {
-                // Special treatment for ->double conversion (e.g. long to double not allowed)
-                if (paramType.id() == QMetaType::Double) {
-                    bool ok;
-                    copy = copy.toDouble(&ok);
-                    if (!ok) {
-                        qWarning() << "Cannot convert" << arg.typeName() << "to" << paramType.name();
-                        return {};
-                    }
-                } else {
-                    qWarning() << "Cannot convert" << arg.typeName() << "to" << paramType.name();
-                    return {};
-                }
-            }
-            if (!copy.convert(paramType)) {
-                qWarning() << "Error converting" << arg.typeName() << "to" << paramType.name();
+        const auto plan = m.argPlans.at(i);
+        const auto paramType = m.paramTypes.at(i);
+        if (plan == ArgPlan::Variant) {
+            argv[i + 1] = const_cast<QVariant*>(&arg);
+        } else if (arg.metaType() == paramType) {
+            argv[i + 1] = const_cast<void*>(arg.constData());
+        } else {
+            QVariant& copy = converted[i];
+            copy = arg;
+            if (!convertArgument(copy, paramType, plan)) {
                 return {};
             }
+            argv[i + 1] = copy.data();
         }
-        converted << copy;
     }
 
-    // Build generic argument list from variant argument list
-    QList<QGenericArgument> args_gen;
-    for (const auto& argument: qAsConst(converted)) {
-        args_gen << QGenericArgument(argument.metaType().name(), const_cast<void*>(argument.constData()));
+    // Direct return value to QVariant
+    QVariant returnValue;
+    switch (m.returnPlan) {
+    case ReturnPlan::Typed:
+        // Create QVariant for known metatype and direct return value to internal data
+        returnValue = QVariant(m.returnType);
+        argv[0] = returnValue.data();
+        break;
+    case ReturnPlan::Variant:
+        // Write QVariant return values directly to returnValue
+        argv[0] = &returnValue;
+        break;
+    case ReturnPlan::Ignore:
+        argv[0] = nullptr;
+        break;
     }
 
-    // Build generic argument for return type
-    const auto methodReturnT = metaMethod.returnMetaType();
-    const auto methodReturnTID = methodReturnT.id();
-    QVariant returnValue;
-    QGenericReturnArgument returnArgument = [&]() -> QGenericReturnArgument {
-        if (methodReturnTID != QMetaType::UnknownType && methodReturnTID != QMetaType::QVariant && methodReturnTID != QMetaType::Void) {
-            // Create QVariant for known metatype and direct return value to internal data
-            returnValue = QVariant(methodReturnT);
-            return {metaMethod.typeName(), const_cast<void*>(returnValue.constData())};
-        }
-        if (methodReturnTID == QMetaType::QVariant) {
-            // Write QVariant return values directly to returnValue
-            return {metaMethod.typeName(), &returnValue};
-        }
-        // Ignore other return values
-        return {"void", &returnValue};
-    }();
-
-    // Invoke method
-    bool ok = metaMethod.invoke(object, Qt::DirectConnection, returnArgument,
-        args_gen.value(0), args_gen.value(1), args_gen.value(2), args_gen.value(3),
-        args_gen.value(4), args_gen.value(5), args_gen.value(6), args_gen.value(7),
-        args_gen.value(8), args_gen.value(9)
-    );
-
-    if (!ok) {
-        qWarning() << "Calling/converting" << metaMethod.methodSignature() << "failed.";
+    // Invoke method, not limited in the number of arguments
+    if (QMetaObject::metacall(m.object, QMetaObject::InvokeMetaMethod, m.methodIndex, argv.data()) >= 0) {
+        qWarning() << "Calling/converting" << m.method.methodSignature() << "failed.";
         return {};
     }
     return returnValue;
 }
 
 
-QRpcServiceBase::QRpcServiceBase(QTcpServer* server, QObject *parent) : QObject(parent), m_server(server)
+// Match name against glob pattern supporting '*' and '?'
+static bool globMatch(QStringView pattern, QStringView name)
+{
+    qsizetype p = 0, n = 0, star = -1, mark = 0;
+    while (n < name.size()) {
+        if (p < pattern.size() && (pattern[p] == u'?' || pattern[p] == name[n])) {
+            ++p;
+            ++n;
+        } else if (p < pattern.size() && pattern[p] == u'*') {
+            star = p++;
+            mark = n;
+        } else if (star >= 0) {
+            p = star + 1;
+            n = ++mark;
+        } else {
+            return false;
+        }
+    }
+    while (p < pattern.size() && pattern[p] == u'*') {
+        ++p;
+    }
+    return p == pattern.size();
+}
+
+
+// Function queued to the thread of a registered object, rejecting the request if it never runs,
+// e.g. because the object was destroyed and its posted events discarded
+class QueuedCall
+{
+public:
+    QueuedCall(std::function<void()> fn, QRpcPromise::Reject reject)
+        : m_fn(std::move(fn)), m_reject(std::move(reject)) { }
+    ~QueuedCall()
+    {
+        if (!m_invoked) {
+            m_reject(std::runtime_error("RPC object destroyed"));
+        }
+    }
+    QueuedCall(const QueuedCall&) = delete;
+    QueuedCall& operator=(const QueuedCall&) = delete;
+
+    static void post(QObject* object, std::function<void()> fn, QRpcPromise::Reject reject)
+    {
+        auto call = std::make_shared<QueuedCall>(std::move(fn), std::move(reject));
+        if (object) {
+            QMetaObject::invokeMethod(object, [call]() {
+                call->m_invoked = true;
+                call->m_fn();
+            }, Qt::QueuedConnection);
+        }
+    }
+
+private:
+    std::function<void()> m_fn;
+    QRpcPromise::Reject m_reject;
+    bool m_invoked = false;
+};
+
+
+// Invoke compiled method and resolve request with its result
+static void invokeAndResolve(const QRpcServiceBase::RpcMethod& m, const QVariantList& args,
+                             const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject,
+                             const QRpcRequestContext& context)
+{
+    // Skip requests the client stopped waiting for while queued
+    if (context.isExpired() || context.isCanceled()) {
+        reject(std::runtime_error("Request deadline exceeded or canceled"));
+        return;
+    }
+    // Object may have been destroyed before a queued or thread pool call started
+    if (m.object.isNull()) {
+        reject(std::runtime_error("RPC object destroyed"));
+        return;
+    }
+    QRpcRequestContext::Scope scope(context);
+    QVariant returnVal;
+    // Try invoking method
+    QRPC_TRACE(MethodInvoked, context.peer(), context.requestId(), QStringView(), 0);
+    try {
+        returnVal = invokeAutoConvert(m, args);
+    }
+    catch (const std::exception& e) {
+        reject(std::runtime_error(e.what()));
+        return;
+    }
+    catch (...) {
+        reject(std::runtime_error("Unknown exception"));
+        return;
+    }
+    // Resolve if return value is not an RPC promise or build chain
+    const bool isRpcPromise = (returnVal.metaType() == QMetaType::fromType<QRpcPromise>());
+    if (!isRpcPromise) {
+        resolve(returnVal);
+        return;
+    }
+    // Chain promise in the object thread, thread pool threads have no event loop
+    const auto p = *reinterpret_cast<const QRpcPromise*>(returnVal.constData());
+    QueuedCall::post(m.object, [p, resolve, reject, context, object = m.object]() {
+        p.then([=](const QVariant& result) {
+            resolve(result);
+        }, [=](const std::exception& e) {
+            reject(std::runtime_error(e.what()));
+        });
+        // Propagate cancellation by the client to the returned promise
+        context.onCanceled(object, [p]() {
+            p.cancel();
+        });
+    }, reject);
+}
+
+
+QRpcEventPolicy QRpcEventPolicy::fromString(QStringView str)
+{
+    const auto tokens = str.split(u';', Qt::SkipEmptyParts);
+    if (tokens.isEmpty()) {
+        return {};
+    }
+    QRpcEventPolicy policy;
+    const auto mode = tokens.first().trimmed();
+    if (mode == u"latest") {
+        policy.mode = Mode::Latest;
+    } else if (mode == u"batch") {
+        policy.mode = Mode::Batch;
+    } else if (mode != u"immediate") {
+        qWarning() << "Unknown event policy" << mode;
+        return {};
+    }
+    for (qsizetype i = 1; i < tokens.size(); ++i) {
+        const auto option = tokens.at(i).split(u'=');
+        bool ok = (option.size() == 2);
+        const int value = ok ? option.at(1).trimmed().toInt(&ok) : 0;
+        const auto key = option.first().trimmed();
+        if (ok && key == u"interval") {
+            policy.interval = value;
+        } else if (ok && key == u"size") {
+            policy.maxBatchSize = value;
+        } else {
+            qWarning() << "Invalid event policy option" << tokens.at(i);
+        }
+    }
+    return policy;
+}
+
+
+QRpcServiceBase::QRpcServiceBase(QTcpServer* server, QObject *parent)
+    : QObject(parent)
+    , m_server(server)
+    , m_handlers(std::make_shared<QRpcHandlerRegistry>())
 {
     // New connection handler
     connect(server, &QTcpServer::newConnection, this, [this]() {
         QTcpSocket* socket;
         while ((socket = m_server->nextPendingConnection()) != nullptr) {
             auto* peer = new QRpcPeer(socket, socket);
+            configurePeer(peer);
+            // Requests of peers served by worker threads are queued to the service thread
             // Handle new rpc requests
             connect(peer, &QRpcPeer::newRequest, this, &QRpcService::handleNewRequest);
-            // Remember peer
-            m_peers.emplace(peer);
-            // Delete socket (and peer) on disconnect
+            // Track event subscriptions, the signal may have been queued before the peer disconnected
+            connect(peer, &QRpcPeer::subscriptionsChanged, this, [this, peer](const QStringList& patterns) {
+                if (m_peers.count(peer) == 0) {
+                    return;
+                }
+                m_subscriptions[peer] = patterns;
+                updateEventRoutes();
+            });
+            // Delete socket (and peer) on disconnect, once no route refers to the peer anymore
             connect(socket, &QTcpSocket::disconnected, this, [this, socket, peer]() {
-                m_peers.erase(peer);
+                if (m_peers.erase(peer) == 0) {
+                    return;
+                }
+                m_subscriptions.erase(peer);
+                updateEventRoutes();
                 socket->deleteLater();
-                peer->deleteLater();
             });
+            // Hand socket (and peer) over to the next worker thread
+            PeerHandle handle{peer, socket, thread()};
+            if (m_active_workers > 0) {
+                const Worker& worker = m_workers.at(m_next_worker++ % m_active_workers);
+                socket->setParent(nullptr);
+                socket->moveToThread(worker.thread.get());
+                handle.thread = worker.thread.get();
+            }
+            // Remember peer
+            m_peers.emplace(peer, std::move(handle));
         }
+        updateEventRoutes();
     });
 }
 
 QRpcServiceBase::~QRpcServiceBase()
 {
-    // Delete remaining peers
-    for (auto* peer: m_peers) {
-        peer->deleteLater();
+    // Delete remaining peers with their sockets, including the sockets handed over to worker threads
+    for (const auto& [key, handle]: m_peers) {
+        if (handle.socket) {
+            handle.socket->deleteLater();
+        }
     }
     m_peers.clear();
+    // Stop worker threads, objects pending deletion are deleted when a thread finishes
+    for (auto& worker: m_workers) {
+        worker.thread->quit();
+        worker.thread->wait();
+    }
+}
+
+void QRpcServiceBase::setWorkerThreads(int n)
+{
+    m_active_workers = static_cast<std::size_t>(std::max(n, 0));
+    while (m_workers.size() < m_active_workers) {
+        Worker worker;
+        worker.thread = std::make_unique<QThread>();
+        worker.thread->setObjectName(QStringLiteral("QRpcWorker%1").arg(m_workers.size()));
+        worker.context = new QObject;
+        worker.context->moveToThread(worker.thread.get());
+        connect(worker.thread.get(), &QThread::finished, worker.context, &QObject::deleteLater);
+        worker.thread->start();
+        m_workers.push_back(std::move(worker));
+    }
+}
+
+QObject* QRpcServiceBase::workerContext(QThread* thread) const
+{
+    for (const auto& worker: m_workers) {
+        if (worker.thread.get() == thread) {
+            return worker.context;
+        }
+    }
+    return nullptr;
+}
+
+void QRpcServiceBase::setSlowConsumerPolicy(QRpcPeer::SlowConsumerPolicy policy)
+{
+    m_slow_consumer_policy = policy;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setWriteBufferWatermarks(qint64 low, qint64 high)
+{
+    m_low_watermark = low;
+    m_high_watermark = high;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setZeroCopyDecoding(bool enabled)
+{
+    m_zero_copy = enabled;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+QRpcPeerMetrics QRpcServiceBase::metrics() const
+{
+    QRpcPeerMetrics metrics;
+    // Metrics are readable from any thread
+    for (const auto& [key, handle]: m_peers) {
+        if (handle.peer) {
+            metrics.merge(handle.peer->metrics());
+        }
+    }
+    return metrics;
+}
+
+void QRpcServiceBase::setStatsMethodEnabled(bool enabled)
+{
+    m_stats_method = enabled;
+}
+
+void QRpcServiceBase::setCompressionThreshold(qint64 bytes)
+{
+    m_compression_threshold = bytes;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setConcurrencyLimits(int perPeerInFlight, int perPeerQueued, int globalInFlight)
+{
+    m_max_in_flight = perPeerInFlight;
+    m_max_queued = perPeerQueued;
+    m_global_limit = (globalInFlight > 0) ? std::make_shared<QRpcConcurrencyLimit>(globalInFlight) : nullptr;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setPauseReadsWhenOverloaded(bool enabled)
+{
+    m_pause_reads = enabled;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setReceiveLimits(const QRpcReceiveLimits& limits)
+{
+    m_receive_limits = limits;
+    for (const auto& [key, handle]: m_peers) {
+        configurePeer(handle.peer);
+    }
+}
+
+void QRpcServiceBase::setSubscriptionRequired(bool required)
+{
+    m_require_subscriptions = required;
+    updateEventRoutes();
+}
+
+void QRpcServiceBase::updateEventRoutes()
+{
+    // Resolve subscribers of each signal, only signals with subscribers stay connected
+    const QMetaMethod handler = metaObject()->method(metaObject()->indexOfSlot("handleRegisteredObjectSignal()"));
+    for (auto& [key, route]: m_events) {
+        route.subscribers.clear();
+        for (const auto& [peer, handle]: m_peers) {
+            const auto it = m_subscriptions.find(peer);
+            if (it == m_subscriptions.end()) {
+                // Peers that never subscribed receive all events unless subscriptions are required
+                if (!m_require_subscriptions) {
+                    route.subscribers.push_back(handle);
+                }
+                continue;
+            }
+            for (const auto& pattern: it->second) {
+                if (globMatch(pattern, route.name)) {
+                    route.subscribers.push_back(handle);
+                    break;
+                }
+            }
+        }
+        if (route.subscribers.empty() && route.connection) {
+            disconnect(route.connection);
+            route.connection = {};
+        } else if (!route.subscribers.empty() && !route.connection) {
+            route.connection = connect(key.first, route.signal, this, handler);
+        }
+    }
+}
+
+void QRpcServiceBase::publishEvent(EventRoute& route, const QVariantList& args)
+{
+    switch (route.policy.mode) {
+    case QRpcEventPolicy::Mode::Immediate:
+        // Serialize event once and forward it to all subscribers
+        sendEvent(route, QRpcEncodedEvent(route.name, args));
+        break;
+    case QRpcEventPolicy::Mode::Latest:
+        // Send first emission right away, conflate emissions until the interval elapsed
+        route.pending = {QVariant(args)};
+        if (!route.timer->isActive()) {
+            flushEvent(route);
+            route.timer->start();
+        }
+        break;
+    case QRpcEventPolicy::Mode::Batch:
+        route.pending.append(QVariant(args));
+        if (route.policy.maxBatchSize > 0 && route.pending.size() >= route.policy.maxBatchSize) {
+            route.timer->stop();
+            flushEvent(route);
+        } else if (!route.timer->isActive()) {
+            route.timer->start();
+        }
+        break;
+    }
+}
+
+void QRpcServiceBase::flushEvent(EventRoute& route)
+{
+    if (route.pending.isEmpty()) {
+        return;
+    }
+    // Serialize pending emissions once and forward them to all subscribers
+    const auto event = (route.policy.mode == QRpcEventPolicy::Mode::Batch)
+        ? QRpcEncodedEvent::batch(route.name, route.pending)
+        : QRpcEncodedEvent(route.name, route.pending.first());
+    route.pending.clear();
+    sendEvent(route, event);
+}
+
+void QRpcServiceBase::sendEvent(const EventRoute& route, const QRpcEncodedEvent& event)
+{
+    // Send to peers of the service thread directly, post one call per worker thread for the others
+    std::map<QThread*, std::vector<QPointer<QRpcPeer>>> remote;
+    for (const auto& subscriber: route.subscribers) {
+        if (subscriber.thread != thread()) {
+            remote[subscriber.thread].push_back(subscriber.peer);
+        } else if (subscriber.peer) {
+            subscriber.peer->sendEvent(event);
+        }
+    }
+    for (auto& [worker_thread, peers]: remote) {
+        QMetaObject::invokeMethod(workerContext(worker_thread), [event, peers = std::move(peers)]() {
+            for (const auto& peer: peers) {
+                if (peer) {
+                    peer->sendEvent(event);
+                }
+            }
+        });
+    }
+}
+
+void QRpcServiceBase::configurePeer(QRpcPeer* peer)
+{
+    if (!peer) {
+        return;
+    }
+    // Configure peer in its thread, directly if it is served by the service thread
+    QMetaObject::invokeMethod(peer, [peer, handlers = m_handlers, policy = m_slow_consumer_policy,
+                                     zeroCopy = m_zero_copy, low = m_low_watermark, high = m_high_watermark,
+                                     maxInFlight = m_max_in_flight, maxQueued = m_max_queued,
+                                     globalLimit = m_global_limit, pauseReads = m_pause_reads,
+                                     compressionThreshold = m_compression_threshold,
+                                     receiveLimits = m_receive_limits]() {
+        peer->setHandlerRegistry(handlers);
+        peer->setSlowConsumerPolicy(policy);
+        peer->setZeroCopyDecoding(zeroCopy);
+        if (high >= 0) {
+            peer->setWriteBufferWatermarks(low, high);
+        }
+        peer->setConcurrencyLimits(maxInFlight, maxQueued);
+        peer->setSharedConcurrencyLimit(globalLimit);
+        peer->setPauseReadsWhenOverloaded(pauseReads);
+        peer->setCompressionThreshold(compressionThreshold);
+        peer->setReceiveLimits(receiveLimits);
+    });
+}
+
+void QRpcServiceBase::registerRawHandler(const QString& method, QRpcHandler handler)
+{
+    m_handlers->insert(method, std::move(handler));
+}
+
+void QRpcServiceBase::unregisterHandler(const QString& method)
+{
+    m_handlers->remove(method);
 }
 
 void QRpcServiceBase::registerObject(const QString& name, QObject* o)
 {
+    registerObject(name, o, {});
+}
+
+void QRpcServiceBase::registerObject(const QString& name, QObject* o,
+                                     const QHash<QString, QRpcEventPolicy>& eventPolicies)
+{
+    // Methods and events are identified by their object, each object is registered once
+    if (m_reg_name_to_obj.count(name) || m_reg_obj_to_name.count(o)) {
+        qWarning() << "QRpcService: Name or object already registered" << name;
+        return;
+    }
     m_reg_name_to_obj.emplace(std::make_pair(name, o));
     m_reg_obj_to_name.emplace(std::make_pair(o, name));
 
-    // Connect all signals of the registered object
+    // Collect methods declared to run in the thread pool
     auto mo = o->metaObject();
-    QMetaMethod handler = metaObject()->method(metaObject()->indexOfSlot("handleRegisteredObjectSignal()"));
+    QSet<QByteArray> poolMethods;
+    const QLatin1String methodPolicyPrefix("QRpcMethodPolicy:");
+    for (int i = 0; i < mo->classInfoCount(); ++i) {
+        const QMetaClassInfo info = mo->classInfo(i);
+        const QLatin1String key(info.name());
+        if (!key.startsWith(methodPolicyPrefix)) {
+            continue;
+        }
+        if (qstrcmp(info.value(), "threadpool") == 0) {
+            poolMethods.insert(QByteArray(info.name()).mid(methodPolicyPrefix.size()));
+        } else {
+            qWarning() << "Unknown method policy" << info.value();
+        }
+    }
+
+    // Compile dispatch table entries for all methods, first method of a given name wins
+    for (int i = mo->methodOffset(); i < mo->methodCount(); ++i) {
+        const QMetaMethod method = mo->method(i);
+        const QString key = name + QLatin1Char('.') + QString::fromLatin1(method.name());
+        if (!m_methods.contains(key)) {
+            auto m = std::make_shared<RpcMethod>(o, method);
+            m->threadPool = poolMethods.contains(method.name());
+            m_methods.insert(key, std::move(m));
+        }
+    }
+
+    // Collect event policies declared by the class, explicit policies take precedence
+    QHash<QString, QRpcEventPolicy> policies;
+    const QLatin1String policyPrefix("QRpcEventPolicy:");
+    for (int i = 0; i < mo->classInfoCount(); ++i) {
+        const QMetaClassInfo info = mo->classInfo(i);
+        const QLatin1String key(info.name());
+        if (key.startsWith(policyPrefix)) {
+            policies.insert(key.sliced(policyPrefix.size()), QRpcEventPolicy::fromString(QString::fromLatin1(info.value())));
+        }
+    }
+    policies.insert(eventPolicies);
+
+    // Create event routes for all signals, connected once a peer subscribes to them
     for (int i = mo->methodOffset(); i < mo->methodCount(); ++i) {
-        QMetaMethod method = mo->method(i);
-        if (method.methodType() == QMetaMethod::Signal && method.access() == QMetaMethod::Public) {
-            connect(o, method, this, handler);
+        const QMetaMethod method = mo->method(i);
+        if (method.methodType() == QMetaMethod::Signal && method.access() == QMetaMethod::Public &&
+            !(method.attributes() & QMetaMethod::Cloned)) {
+            EventRoute route;
+            route.name = name + QLatin1Char('.') + QString::fromLatin1(method.name());
+            route.signal = method;
+            route.policy = policies.value(QString::fromLatin1(method.name()));
+            const auto key = std::make_pair(o, i);
+            if (route.policy.mode != QRpcEventPolicy::Mode::Immediate) {
+                route.timer = std::make_unique<QTimer>();
+                route.timer->setSingleShot(true);
+                route.timer->setInterval(route.policy.interval);
+                connect(route.timer.get(), &QTimer::timeout, this, [this, key]() {
+                    const auto it = m_events.find(key);
+                    if (it == m_events.end()) {
+                        return;
+                    }
+                    EventRoute& r = it->second;
+                    const bool sending = !r.pending.isEmpty();
+                    flushEvent(r);
+                    // Keep limiting the rate after sending a conflated emission
+                    if (sending && r.policy.mode == QRpcEventPolicy::Mode::Latest) {
+                        r.timer->start();
+                    }
+                });
+            }
+            m_events.emplace(key, std::move(route));
         }
     }
+    updateEventRoutes();
 
     // Unregister object if it is destroyed externally
     connect(o, &QObject::destroyed, this, [this, name](){
@@ -144,6 +700,14 @@ void QRpcServiceBase::unregisterObject(const QString& name)
         disconnect(o, nullptr, this, nullptr);
         m_reg_name_to_obj.erase(name);
         m_reg_obj_to_name.erase(o);
+        // Methods of a destroyed object no longer refer to it, match them by name
+        const QString prefix = name + QLatin1Char('.');
+        for (auto it = m_methods.begin(); it != m_methods.end();) {
+            it = it.key().startsWith(prefix) ? m_methods.erase(it) : std::next(it);
+        }
+        for (auto it = m_events.begin(); it != m_events.end();) {
+            it = (it->first.first == o) ? m_events.erase(it) : std::next(it);
+        }
     } catch (const std::out_of_range&) {
         return;
     }
@@ -151,61 +715,60 @@ void QRpcServiceBase::unregisterObject(const QString& name)
 
 void QRpcServiceBase::handleNewRequest(
     const QString& method, const QVariant& args,
-    const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject)
+    const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject,
+    const QRpcRequestContext& context)
 {
-    const auto sep = method.indexOf('.');
-    QString obj_name = (sep > 0) ? method.left(sep) : QStringLiteral("");
-    QString method_name = method.mid(sep+1);
+    // Skip requests the client stopped waiting for
+    if (context.isExpired() || context.isCanceled()) {
+        reject(std::runtime_error("Request deadline exceeded or canceled"));
+        return;
+    }
 
-    // Find registered object or resolve with error
-    auto obj_iter = m_reg_name_to_obj.find(obj_name);
-    if (obj_iter == m_reg_name_to_obj.end()) {
-        reject(std::runtime_error("RPC object not found"));
+    // Built-in method serving the metrics of all peers
+    if (m_stats_method && method == u"rpc.stats") {
+        resolve(QVariantMap{
+            {"peers", static_cast<qulonglong>(m_peers.size())},
+            {"total", metrics().toVariantMap()},
+        });
         return;
     }
-    QObject* o = obj_iter->second;
 
-    // Find requested method in Qt meta object
-    const QMetaObject* mo = o->metaObject();
-    for (int i = mo->methodOffset(); i < mo->methodCount(); ++i) {
-        const QMetaMethod mm = mo->method(i);
-        if (mm.name() == method_name) {
-            QVariant returnVal;
-            QVariantList callArgs;
-            if (args.isValid()) {
-                if (args.metaType().id() == QMetaType::QVariantList) {
-                    callArgs = args.toList();
-                } else {
-                    callArgs.append(args);
-                }
-            }
-            // Try invoking method
-			try {
-                returnVal = invokeAutoConvert(o, mm, callArgs);
-			}
-            catch (const std::exception& e) {
-                reject(std::runtime_error(e.what()));
-            }
-            catch (...) {
-                reject(std::runtime_error("Unknown exception"));
-            }
-            // Resolve if return value is not an RPC promise or build chain
-            const bool isRpcPromise = (returnVal.metaType() == QMetaType::fromType<QRpcPromise>());
-            if (!isRpcPromise) {
-                resolve(returnVal);
-            } else {
-                const auto& p = *reinterpret_cast<const QRpcPromise*>(returnVal.constData());
-                p.then([=](const QVariant& result) {
-                    resolve(result);
-                }, [=](const std::exception& e) {
-                    reject(std::runtime_error(e.what()));
-                });
-            }
-            return;
+    // Find compiled method, requests without object name address the object registered as ""
+    const auto sep = method.indexOf('.');
+    const auto method_iter = (sep > 0) ? m_methods.constFind(method)
+                                       : m_methods.constFind(QLatin1Char('.') + method.mid(sep + 1));
+    if (method_iter == m_methods.cend()) {
+        // Method or object not found, resolve with error
+        const QString obj_name = (sep > 0) ? method.left(sep) : QStringLiteral("");
+        const bool obj_found = (m_reg_name_to_obj.find(obj_name) != m_reg_name_to_obj.end());
+        reject(std::runtime_error(obj_found ? "RPC method not found" : "RPC object not found"));
+        return;
+    }
+    std::shared_ptr<const RpcMethod> m = *method_iter;
+
+    QVariantList callArgs;
+    if (args.isValid()) {
+        if (args.metaType().id() == QMetaType::QVariantList) {
+            callArgs = args.toList();
+        } else {
+            callArgs.append(args);
         }
     }
-    // Method was not found in meta object
-    reject(std::runtime_error("RPC method not found"));
+    // Invoke in thread pool, queue to object thread or invoke directly
+    const QPointer<QObject> object = m->object;
+    if (object.isNull()) {
+        reject(std::runtime_error("RPC object destroyed"));
+    } else if (m->threadPool) {
+        QThreadPool::globalInstance()->start([m, callArgs, resolve, reject, context]() {
+            invokeAndResolve(*m, callArgs, resolve, reject, context);
+        });
+    } else if (object->thread() != QThread::currentThread()) {
+        QueuedCall::post(object, [m, callArgs, resolve, reject, context]() {
+            invokeAndResolve(*m, callArgs, resolve, reject, context);
+        }, reject);
+    } else {
+        invokeAndResolve(*m, callArgs, resolve, reject, context);
+    }
 }
 
 void QRpcServiceBase::handleRegisteredObjectSignal()
@@ -230,21 +793,21 @@ int QRpcService::qt_metacall(QMetaObject::Call c, int id, void **a)
         return QRpcServiceBase::qt_metacall(c, id, a);
     }
 
-    // Inspect sender and signal
-    QObject* o = sender();
-    QMetaMethod signal = o->metaObject()->method(senderSignalIndex());
-    QString event_name = m_reg_obj_to_name.at(o) + "." + signal.name();
+    // Find event route of sender signal, nothing to do without subscribers
+    const auto route_iter = m_events.find(std::make_pair(sender(), senderSignalIndex()));
+    if (route_iter == m_events.end() || route_iter->second.subscribers.empty()) {
+        return -1;
+    }
+    EventRoute& route = route_iter->second;
 
     // Convert signal args to QVariantList
     QVariantList args;
-    for (int i = 0; i < signal.parameterCount(); ++i) {
-        args << QVariant(signal.parameterMetaType(i), a[i+1]);
+    for (int i = 0; i < route.signal.parameterCount(); ++i) {
+        args << QVariant(route.signal.parameterMetaType(i), a[i+1]);
     }
 
-    // Forward event to all peers
-    for (auto peer: m_peers) {
-        peer->sendEvent(event_name, args);
-    }
+    // Forward according to event policy
+    publishEvent(route, args);
 
     return -1;
 }
@@ -0,0 +1,92 @@
+#include <QRpcTracer.hpp>
+#include <QtCore/QJsonDocument>
+#include <QtCore/QJsonObject>
+#include <QtCore/QThread>
+#include <array>
+#include <atomic>
+
+
+static std::atomic<QRpcTracer*> s_tracer{nullptr};
+
+void QRpcTracer::install(QRpcTracer* tracer)
+{
+    s_tracer.store(tracer, std::memory_order_release);
+}
+
+QRpcTracer* QRpcTracer::instance()
+{
+    return s_tracer.load(std::memory_order_acquire);
+}
+
+
+static QString stageName(QRpcTracer::Stage stage)
+{
+    static const std::array<QString, 7> names{
+        "bytes read", "decoded", "request emitted", "method invoked", "resolved", "response packed", "bytes flushed",
+    };
+    return names.at(static_cast<std::size_t>(stage));
+}
+
+QRpcChromeTracer::QRpcChromeTracer(const QString& fileName)
+    : m_file(fileName)
+{
+    if (m_file.open(QIODevice::WriteOnly | QIODevice::Truncate)) {
+        m_file.write("[\n");
+    }
+    m_timer.start();
+}
+
+QRpcChromeTracer::~QRpcChromeTracer()
+{
+    if (m_file.isOpen()) {
+        m_file.write("\n]\n");
+    }
+}
+
+void QRpcChromeTracer::trace(const Event& event)
+{
+    const double ts = static_cast<double>(m_timer.nsecsElapsed()) / 1000.0;
+    QJsonObject json{
+        {"cat", "rpc"},
+        {"ts", ts},
+        {"pid", 0},
+        {"tid", static_cast<qint64>(reinterpret_cast<quintptr>(QThread::currentThreadId()))},
+    };
+
+    QMutexLocker lock(&m_mutex);
+    if (!m_file.isOpen()) {
+        return;
+    }
+    if (event.id == 0) {
+        // Device activity, shown as instant in the thread
+        json.insert("name", stageName(event.stage));
+        json.insert("ph", "i");
+        json.insert("s", "t");
+        json.insert("args", QJsonObject{{"bytes", event.bytes}});
+    } else {
+        // Request stages, shown as async slice from decoding to packing the response
+        const QString key = QString("%1:%2").arg(reinterpret_cast<quintptr>(event.peer)).arg(event.id);
+        QString method = event.method.toString();
+        if (event.stage == Stage::Decoded) {
+            m_methods.insert(key, method);
+        } else if (method.isEmpty()) {
+            method = m_methods.value(key);
+        }
+        const char* phase = "n";
+        if (event.stage == Stage::Decoded) {
+            phase = "b";
+        } else if (event.stage == Stage::ResponsePacked) {
+            phase = "e";
+            m_methods.remove(key);
+        }
+        json.insert("name", method);
+        json.insert("ph", phase);
+        json.insert("id", key);
+        json.insert("args", QJsonObject{{"stage", stageName(event.stage)}});
+    }
+    if (!m_first) {
+        m_file.write(",\n");
+    }
+    m_first = false;
+    m_file.write(QJsonDocument(json).toJson(QJsonDocument::Compact));
+}
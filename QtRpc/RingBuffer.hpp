@@ -0,0 +1,96 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+
+
+/**
+ * Byte FIFO backed by a ring of power of two capacity. The ring keeps its
+ * initial capacity as long as the data fits and grows by doubling otherwise.
+ * A grown ring returns to its initial capacity by shrink() once it is empty.
+ */
+class RingBuffer
+{
+public:
+    explicit RingBuffer(std::size_t capacity = 64 * 1024)
+        : m_initial_capacity(roundUpPow2(capacity))
+        , m_capacity(m_initial_capacity)
+        , m_data(new char[m_capacity])
+    { }
+
+    std::size_t size() const { return m_size; }
+    std::size_t capacity() const { return m_capacity; }
+    bool isEmpty() const { return m_size == 0; }
+
+    void append(const char* data, std::size_t n_data)
+    {
+        reserve(m_size + n_data);
+        const std::size_t tail = (m_head + m_size) & (m_capacity - 1);
+        const std::size_t n_first = std::min(n_data, m_capacity - tail);
+        std::memcpy(m_data.get() + tail, data, n_first);
+        std::memcpy(m_data.get(), data + n_first, n_data - n_first);
+        m_size += n_data;
+    }
+
+    // Contiguous block of data at the front of the buffer
+    const char* readPointer() const { return m_data.get() + m_head; }
+    std::size_t readSize() const { return std::min(m_size, m_capacity - m_head); }
+
+    void consume(std::size_t n)
+    {
+        n = std::min(n, m_size);
+        m_head = (m_head + n) & (m_capacity - 1);
+        m_size -= n;
+        if (m_size == 0) {
+            m_head = 0;
+        }
+    }
+
+    void clear()
+    {
+        m_head = 0;
+        m_size = 0;
+    }
+
+    void shrink()
+    {
+        if (m_size == 0 && m_capacity > m_initial_capacity) {
+            m_data.reset(new char[m_initial_capacity]);
+            m_capacity = m_initial_capacity;
+            m_head = 0;
+        }
+    }
+
+private:
+    static std::size_t roundUpPow2(std::size_t n)
+    {
+        std::size_t p = 1;
+        while (p < n) {
+            p <<= 1;
+        }
+        return p;
+    }
+
+    void reserve(std::size_t n)
+    {
+        if (n <= m_capacity) {
+            return;
+        }
+        // Grow and move existing data to the front of the new storage
+        const std::size_t capacity = roundUpPow2(n);
+        std::unique_ptr<char[]> data(new char[capacity]);
+        const std::size_t n_first = readSize();
+        std::memcpy(data.get(), readPointer(), n_first);
+        std::memcpy(data.get() + n_first, m_data.get(), m_size - n_first);
+        m_data = std::move(data);
+        m_capacity = capacity;
+        m_head = 0;
+    }
+
+    std::size_t m_initial_capacity;
+    std::size_t m_capacity;
+    std::unique_ptr<char[]> m_data;
+    std::size_t m_head = 0;
+    std::size_t m_size = 0;
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+
+/**
+ * Hashed timer wheel for large numbers of timeouts. Timeouts are inserted
+ * in constant time into the slot of their deadline tick and expire when the
+ * wheel is advanced past their deadline. Timeouts are not removed when they
+ * become obsolete, the caller ignores expired ids it no longer tracks.
+ */
+class TimerWheel
+{
+public:
+    explicit TimerWheel(std::int64_t resolution = 10, std::size_t n_slots = 256)
+        : m_resolution(resolution)
+        , m_slots(n_slots)
+    { }
+
+    std::int64_t resolution() const { return m_resolution; }
+    std::size_t size() const { return m_size; }
+    bool isEmpty() const { return m_size == 0; }
+
+    // Add timeout for id expiring at deadline (in ms of a monotonic clock)
+    void insert(std::uint64_t id, std::int64_t deadline)
+    {
+        const std::int64_t tick = std::max(toTick(deadline), m_tick + 1);
+        m_slots[slotIndex(tick)].push_back({id, tick});
+        ++m_size;
+    }
+
+    // Advance wheel to the current time, calling expired(id) for each timeout past its deadline
+    template <typename F>
+    void advance(std::int64_t now, F&& expired)
+    {
+        const std::int64_t target = toTick(now);
+        if (target <= m_tick) {
+            return;
+        }
+        // Each slot is visited at most once, even if the wheel was not advanced for a full turn
+        const auto n_steps = std::min<std::int64_t>(target - m_tick, static_cast<std::int64_t>(m_slots.size()));
+        m_tick = target;
+        for (std::int64_t step = 0; step < n_steps; ++step) {
+            auto& slot = m_slots[slotIndex(target - step)];
+            auto keep = std::partition(slot.begin(), slot.end(), [target](const Entry& e) {
+                return e.tick > target;
+            });
+            std::vector<Entry> due(keep, slot.end());
+            slot.erase(keep, slot.end());
+            m_size -= due.size();
+            for (const auto& e: due) {
+                expired(e.id);
+            }
+        }
+    }
+
+private:
+    struct Entry
+    {
+        std::uint64_t id;
+        std::int64_t tick;
+    };
+
+    std::int64_t toTick(std::int64_t time) const { return (time + m_resolution - 1) / m_resolution; }
+    std::size_t slotIndex(std::int64_t tick) const { return static_cast<std::size_t>(tick) % m_slots.size(); }
+
+    std::int64_t m_resolution;
+    std::vector<std::vector<Entry>> m_slots;
+    std::int64_t m_tick = 0;
+    std::size_t m_size = 0;
+};
@@ -0,0 +1,19 @@
+#pragma once
+#include <QRpcTracer.hpp>
+
+
+/**
+ * Report a request lifecycle event to the installed QRpcTracer. Compiled out
+ * unless QTRPC_ENABLE_TRACING is defined, arguments are only evaluated while
+ * a tracer is installed.
+ */
+#ifdef QTRPC_ENABLE_TRACING
+#define QRPC_TRACE(stage, peer, id, method, bytes) \
+    do { \
+        if (auto* qrpc_tracer_ = QRpcTracer::instance()) { \
+            qrpc_tracer_->trace({QRpcTracer::Stage::stage, (peer), (id), (method), (bytes)}); \
+        } \
+    } while (false)
+#else
+#define QRPC_TRACE(stage, peer, id, method, bytes) do { } while (false)
+#endif
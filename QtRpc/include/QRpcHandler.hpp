@@ -0,0 +1,191 @@
+#pragma once
+#include <QtRpc_export.hpp>
+#include <QtMsgpackAdaptor.hpp>
+#include <QtCore/QHash>
+#include <QtCore/QReadWriteLock>
+#include <QtCore/QString>
+#include <msgpack.hpp>
+#include <functional>
+#include <memory>
+#include <stdexcept>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+
+/**
+ * @brief QRpcResponse Response channel for requests answered by a QRpcHandler.
+ *
+ * Results are packed directly into the outgoing response message.
+ */
+class QTRPC_EXPORT QRpcResponse
+{
+public:
+    using Packer = msgpack::packer<msgpack::sbuffer>;
+
+    virtual ~QRpcResponse() = default;
+
+    /**
+     * @brief resolve Respond with result value.
+     * @param value Value of any type msgpack is able to pack.
+     */
+    template <typename T>
+    void resolve(const T& value)
+    {
+        Packer& packer = beginResult();
+        packer.pack(value);
+        endResult();
+    }
+
+    /**
+     * @brief resolve Respond without result value.
+     */
+    void resolve()
+    {
+        beginResult().pack_nil();
+        endResult();
+    }
+
+    /**
+     * @brief reject Respond with error.
+     * @param error Error message.
+     */
+    virtual void reject(std::string_view error) = 0;
+
+protected:
+    virtual Packer& beginResult() = 0;
+    virtual void endResult() = 0;
+};
+
+
+/**
+ * @brief QRpcHandler Request handler operating on the undecoded msgpack arguments.
+ */
+using QRpcHandler = std::function<void(const msgpack::object& args, QRpcResponse& response)>;
+
+
+/**
+ * @brief QRpcHandlerRegistry Map of method names to request handlers.
+ *
+ * The registry is thread-safe, peers served by different threads may share it.
+ */
+class QRpcHandlerRegistry
+{
+public:
+    void insert(const QString& method, QRpcHandler handler)
+    {
+        auto h = std::make_shared<const QRpcHandler>(std::move(handler));
+        QWriteLocker locker(&m_lock);
+        m_handlers.insert(method, std::move(h));
+    }
+
+    void remove(const QString& method)
+    {
+        QWriteLocker locker(&m_lock);
+        m_handlers.remove(method);
+    }
+
+    std::shared_ptr<const QRpcHandler> find(const QString& method) const
+    {
+        QReadLocker locker(&m_lock);
+        return m_handlers.value(method);
+    }
+
+    bool isEmpty() const
+    {
+        QReadLocker locker(&m_lock);
+        return m_handlers.isEmpty();
+    }
+
+private:
+    mutable QReadWriteLock m_lock;
+    QHash<QString, std::shared_ptr<const QRpcHandler>> m_handlers;
+};
+
+
+namespace QRpcDetail {
+
+template <typename F>
+struct CallableTraits : CallableTraits<decltype(&F::operator())> { };
+
+template <typename R, typename... Args>
+struct CallableTraits<R(*)(Args...)>
+{
+    using Return = R;
+    using Arguments = std::tuple<std::decay_t<Args>...>;
+};
+
+template <typename R, typename... Args>
+struct CallableTraits<R(Args...)> : CallableTraits<R(*)(Args...)> { };
+
+template <typename C, typename R, typename... Args>
+struct CallableTraits<R(C::*)(Args...)> : CallableTraits<R(*)(Args...)> { };
+
+template <typename C, typename R, typename... Args>
+struct CallableTraits<R(C::*)(Args...) const> : CallableTraits<R(*)(Args...)> { };
+
+// Decode request arguments into typed values, a single argument may be sent without array
+template <typename Tuple, std::size_t... I>
+void convertArguments([[maybe_unused]] const msgpack::object& args,
+                      [[maybe_unused]] Tuple& values, std::index_sequence<I...>)
+{
+    constexpr std::size_t n_args = sizeof...(I);
+    if constexpr (n_args == 1) {
+        if (args.type != msgpack::type::ARRAY) {
+            args.convert(std::get<0>(values));
+            return;
+        }
+    }
+    if constexpr (n_args > 0) {
+        if (args.type != msgpack::type::ARRAY || args.via.array.size < n_args) {
+            throw std::runtime_error("Insufficient arguments");
+        }
+        (args.via.array.ptr[I].convert(std::get<I>(values)), ...);
+    }
+}
+
+}  // namespace QRpcDetail
+
+
+/**
+ * @brief makeRpcHandler Wrap a typed callable as request handler.
+ *
+ * The signature of the callable is deduced at compile time. Arguments are decoded from
+ * msgpack directly into the (default constructible) parameter types and the return value
+ * is packed directly into the response, without going through QVariant.
+ * @param f Function, function pointer or non-generic lambda.
+ * @return Request handler.
+ */
+template <typename F>
+QRpcHandler makeRpcHandler(F&& f)
+{
+    using Traits = QRpcDetail::CallableTraits<std::remove_pointer_t<std::decay_t<F>>>;
+    using Return = typename Traits::Return;
+    using Arguments = typename Traits::Arguments;
+
+    return [f = std::forward<F>(f)](const msgpack::object& args, QRpcResponse& response) mutable {
+        Arguments values;
+        try {
+            QRpcDetail::convertArguments(args, values, std::make_index_sequence<std::tuple_size_v<Arguments>>{});
+        } catch (const msgpack::type_error&) {
+            response.reject("Cannot convert arguments");
+            return;
+        } catch (const std::exception& e) {
+            response.reject(e.what());
+            return;
+        }
+        try {
+            if constexpr (std::is_void_v<Return>) {
+                std::apply(f, std::move(values));
+                response.resolve();
+            } else {
+                response.resolve(std::apply(f, std::move(values)));
+            }
+        } catch (const std::exception& e) {
+            response.reject(e.what());
+        } catch (...) {
+            response.reject("Unknown exception");
+        }
+    };
+}
@@ -0,0 +1,233 @@
+#pragma once
+#include <QtCore/QHash>
+#include <QtCore/QString>
+#include <QtCore/QVariant>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+
+/**
+ * @brief QRpcCounter Counter written by a single thread and readable from any thread.
+ */
+class QRpcCounter
+{
+public:
+    // Plain load and store instead of a locked read-modify-write, there is only one writer
+    void add(quint64 n = 1) { m_value.store(m_value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+    void set(quint64 value) { m_value.store(value, std::memory_order_relaxed); }
+    quint64 value() const { return m_value.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<quint64> m_value{0};
+};
+
+
+/**
+ * @brief QRpcLatencyHistogram Log-linear histogram of durations in microseconds.
+ *
+ * Each power of two is divided into 8 linear buckets, percentiles are accurate to 12.5%.
+ * The histogram is written by a single thread and readable from any thread.
+ */
+class QRpcLatencyHistogram
+{
+public:
+    static constexpr int s_sub_bits = 3;
+    static constexpr int s_n_sub = 1 << s_sub_bits;
+    static constexpr int s_max_exponent = 35;  // about 9.5 hours, longer durations are clamped
+    static constexpr int s_n_buckets = (s_max_exponent - s_sub_bits + 2) * s_n_sub;
+
+    /**
+     * @brief Snapshot Copy of the histogram, e.g. for computing percentiles.
+     */
+    struct Snapshot
+    {
+        quint64 count = 0;
+        quint64 sum = 0;
+        quint64 max = 0;
+        std::array<quint64, s_n_buckets> buckets{};
+
+        double mean() const { return count ? static_cast<double>(sum) / static_cast<double>(count) : 0.0; }
+
+        /**
+         * @brief percentile Return the upper bound of the bucket containing the given percentile.
+         * @param q Percentile in the range 0 to 1.
+         */
+        quint64 percentile(double q) const
+        {
+            if (count == 0) {
+                return 0;
+            }
+            const auto target = std::max<quint64>(static_cast<quint64>(std::ceil(q * static_cast<double>(count))), 1);
+            quint64 n = 0;
+            for (int i = 0; i < s_n_buckets; ++i) {
+                n += buckets[i];
+                if (n >= target) {
+                    return std::min(bucketUpperBound(i), max);
+                }
+            }
+            return max;
+        }
+
+        void merge(const Snapshot& other)
+        {
+            count += other.count;
+            sum += other.sum;
+            max = std::max(max, other.max);
+            for (int i = 0; i < s_n_buckets; ++i) {
+                buckets[i] += other.buckets[i];
+            }
+        }
+    };
+
+    void record(quint64 us)
+    {
+        m_buckets[bucketIndex(us)].add();
+        m_count.add();
+        m_sum.add(us);
+        if (us > m_max.value()) {
+            m_max.set(us);
+        }
+    }
+
+    Snapshot snapshot() const
+    {
+        Snapshot s;
+        s.count = m_count.value();
+        s.sum = m_sum.value();
+        s.max = m_max.value();
+        for (int i = 0; i < s_n_buckets; ++i) {
+            s.buckets[i] = m_buckets[i].value();
+        }
+        return s;
+    }
+
+    static int bucketIndex(quint64 v)
+    {
+        if (v < s_n_sub) {
+            return static_cast<int>(v);
+        }
+        const int exponent = std::bit_width(v) - 1;
+        if (exponent > s_max_exponent) {
+            return s_n_buckets - 1;
+        }
+        const auto mantissa = static_cast<int>((v >> (exponent - s_sub_bits)) & (s_n_sub - 1));
+        return (exponent - s_sub_bits + 1) * s_n_sub + mantissa;
+    }
+
+    static quint64 bucketUpperBound(int index)
+    {
+        if (index < s_n_sub) {
+            return static_cast<quint64>(index);
+        }
+        const int shift = index / s_n_sub - 1;
+        const auto lower = static_cast<quint64>(s_n_sub + index % s_n_sub) << shift;
+        return lower + (quint64(1) << shift) - 1;
+    }
+
+private:
+    std::array<QRpcCounter, s_n_buckets> m_buckets;
+    QRpcCounter m_count;
+    QRpcCounter m_sum;
+    QRpcCounter m_max;
+};
+
+
+/**
+ * @brief QRpcMethodStats Counters of the requests received for a method.
+ */
+struct QRpcMethodStats
+{
+    QRpcCounter calls;
+    QRpcCounter errors;
+    QRpcLatencyHistogram latency;  ///< From receiving the request until the response is in the write buffer.
+};
+
+
+/**
+ * @brief QRpcMethodMetrics Snapshot of QRpcMethodStats.
+ */
+struct QRpcMethodMetrics
+{
+    quint64 calls = 0;
+    quint64 errors = 0;
+    QRpcLatencyHistogram::Snapshot latency;
+
+    void merge(const QRpcMethodMetrics& other)
+    {
+        calls += other.calls;
+        errors += other.errors;
+        latency.merge(other.latency);
+    }
+
+    QVariantMap toVariantMap() const
+    {
+        return {
+            {"calls", calls},
+            {"errors", errors},
+            {"latency_us", QVariantMap{
+                {"count", latency.count},
+                {"mean", latency.mean()},
+                {"p50", latency.percentile(0.5)},
+                {"p90", latency.percentile(0.9)},
+                {"p99", latency.percentile(0.99)},
+                {"max", latency.max},
+            }},
+        };
+    }
+};
+
+
+/**
+ * @brief QRpcPeerMetrics Snapshot of the counters of a peer, see QRpcPeer::metrics().
+ */
+struct QRpcPeerMetrics
+{
+    quint64 requestsReceived = 0;
+    quint64 requestsSent = 0;
+    quint64 bytesReceived = 0;
+    quint64 bytesSent = 0;
+    // Depths at the time of the last activity of the peer
+    quint64 pendingResponses = 0;
+    quint64 writeBufferBytes = 0;
+    quint64 requestsInFlight = 0;
+    quint64 requestsQueued = 0;
+    QHash<QString, QRpcMethodMetrics> methods;
+
+    void merge(const QRpcPeerMetrics& other)
+    {
+        requestsReceived += other.requestsReceived;
+        requestsSent += other.requestsSent;
+        bytesReceived += other.bytesReceived;
+        bytesSent += other.bytesSent;
+        pendingResponses += other.pendingResponses;
+        writeBufferBytes += other.writeBufferBytes;
+        requestsInFlight += other.requestsInFlight;
+        requestsQueued += other.requestsQueued;
+        for (auto it = other.methods.cbegin(); it != other.methods.cend(); ++it) {
+            methods[it.key()].merge(it.value());
+        }
+    }
+
+    QVariantMap toVariantMap() const
+    {
+        QVariantMap methodMaps;
+        for (auto it = methods.cbegin(); it != methods.cend(); ++it) {
+            methodMaps.insert(it.key(), it.value().toVariantMap());
+        }
+        return {
+            {"requests_received", requestsReceived},
+            {"requests_sent", requestsSent},
+            {"bytes_received", bytesReceived},
+            {"bytes_sent", bytesSent},
+            {"pending_responses", pendingResponses},
+            {"write_buffer_bytes", writeBufferBytes},
+            {"requests_in_flight", requestsInFlight},
+            {"requests_queued", requestsQueued},
+            {"methods", methodMaps},
+        };
+    }
+};
@@ -1,12 +1,29 @@
 #pragma once
 #include <QtRpc_export.hpp>
+#include <QRpcMetrics.hpp>
+#include <QtCore/QDeadlineTimer>
+#include <QtCore/QMutex>
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
 #include <QtCore/QString>
+#include <QtCore/QStringList>
+#include <QtCore/QTimer>
 #include <QtCore/QVariant>
 #include <QtPromise>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <limits>
 #include <memory>
+#include <optional>
+#include <utility>
+#include <vector>
 
+class QFile;
 class QIODevice;
+class QRpcHandlerRegistry;
+class QRpcPeer;
+class QRpcStreamReader;
 
 class QTRPC_EXPORT QRpcPromise : public QtPromise::QPromise<QVariant>
 {
@@ -18,20 +35,353 @@ public:
         : QtPromise::QPromise<QVariant>([](const Resolve& r) { r(QVariant{}); })
     { }
 
-    template <typename F, typename = std::enable_if_t<!std::is_same_v<F, QRpcPromise>>>
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, QRpcPromise>>>
     QRpcPromise(F&& resolver) : QtPromise::QPromise<QVariant>(std::forward<F>(resolver)) { }
 
+    /**
+     * @brief cancel Cancel the operation the promise is waiting for.
+     *
+     * Canceling a promise returned by QRpcPeer::sendRequest() cancels the request at the remote
+     * peer and rejects the promise with QtPromise::QPromiseCanceledException. Copies of the promise
+     * and promises chained with QVariant results share the canceler.
+     */
+    void cancel() const
+    {
+        if (m_cancel && m_cancel->canceler) {
+            m_cancel->canceler();
+        }
+    }
+
+    /**
+     * @brief onCancel Set function canceling the operation the promise is waiting for.
+     *
+     * Promises returned by methods of objects registered at a QRpcService are canceled if the
+     * client cancels the request.
+     * @param canceler Function called by cancel().
+     * @return Reference to this promise.
+     */
+    QRpcPromise& onCancel(std::function<void()> canceler)
+    {
+        if (!m_cancel) {
+            m_cancel = std::make_shared<CancelState>();
+        }
+        m_cancel->canceler = std::move(canceler);
+        return *this;
+    }
+
+    template <typename... Args>
+    auto then(Args&&... args) const
+    {
+        return chain(QtPromise::QPromise<QVariant>::then(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    auto fail(Args&&... args) const
+    {
+        return chain(QtPromise::QPromise<QVariant>::fail(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    auto finally(Args&&... args) const
+    {
+        return chain(QtPromise::QPromise<QVariant>::finally(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    auto tap(Args&&... args) const
+    {
+        return chain(QtPromise::QPromise<QVariant>::tap(std::forward<Args>(args)...));
+    }
+
+    template <typename... Args>
+    auto timeout(Args&&... args) const
+    {
+        return chain(QtPromise::QPromise<QVariant>::timeout(std::forward<Args>(args)...));
+    }
+
 private:
     virtual void _compilerGuide_();
+
+    // Canceler shared by copies and chained promises, created once a canceler is set
+    struct CancelState
+    {
+        std::function<void()> canceler;
+    };
+
+    // Chained promises with QVariant results keep canceling the operation of this promise
+    template <typename T>
+    static QtPromise::QPromise<T> chain(QtPromise::QPromise<T> promise) { return promise; }
+
+    QRpcPromise chain(const QtPromise::QPromise<QVariant>& promise) const
+    {
+        QRpcPromise chained(promise);
+        chained.m_cancel = m_cancel;
+        return chained;
+    }
+
+    std::shared_ptr<CancelState> m_cancel;
 };
 Q_DECLARE_METATYPE(QRpcPromise)
 
 
+/**
+ * @brief QRpcStreamGenerator Result of an RPC method producing its items incrementally.
+ *
+ * Clients reading the result via QRpcPeer::sendStreamRequest() receive the items in chunks,
+ * the generator is only called as long as the client granted credit for more items. The request
+ * counts against the concurrency limits of the peer until the stream ended. Other clients and
+ * batches receive all items as a single list, streams of more than 65536 items are rejected for
+ * them. The generator is called in the thread of the peer serving the request.
+ */
+class QTRPC_EXPORT QRpcStreamGenerator
+{
+public:
+    using Next = std::function<std::optional<QVariant>()>;
+
+    QRpcStreamGenerator() = default;
+
+    /**
+     * @brief QRpcStreamGenerator Create stream from generator function.
+     * @param next Function returning the next item, or no value at the end of the stream.
+     */
+    explicit QRpcStreamGenerator(Next next) : m_next(std::move(next)) { }
+
+    std::optional<QVariant> next() const { return m_next ? m_next() : std::nullopt; }
+
+private:
+    Next m_next;
+};
+Q_DECLARE_METATYPE(QRpcStreamGenerator)
+
+
+/**
+ * @brief QRpcRequestContext Information about a received request, e.g. the time left for answering it.
+ */
+class QTRPC_EXPORT QRpcRequestContext
+{
+public:
+    QRpcRequestContext() = default;
+    explicit QRpcRequestContext(QDeadlineTimer deadline, bool cancelable = false,
+                                const QRpcPeer* peer = nullptr, std::uint64_t requestId = 0);
+
+    /**
+     * @brief peer Return the peer that received the request, for identification only.
+     */
+    const QRpcPeer* peer() const { return m_peer; }
+
+    /**
+     * @brief requestId Return the id of the request, unique among the pending requests of its peer.
+     */
+    std::uint64_t requestId() const { return m_request_id; }
+
+    /**
+     * @brief deadline Return the deadline of the request, the client stops waiting for a response afterwards.
+     */
+    QDeadlineTimer deadline() const { return m_deadline; }
+
+    /**
+     * @brief isExpired Return true if the client already stopped waiting for a response.
+     */
+    bool isExpired() const { return m_deadline.hasExpired(); }
+
+    /**
+     * @brief isCanceled Return true if the client canceled the request.
+     */
+    bool isCanceled() const;
+
+    /**
+     * @brief onCanceled Call function once the client cancels the request.
+     * @param receiver Object in whose thread the function is called, function is not called once it is destroyed.
+     * @param f Function.
+     */
+    void onCanceled(QObject* receiver, std::function<void()> f) const;
+
+    /**
+     * @brief cancel Mark request as canceled and call the functions registered via onCanceled().
+     *
+     * Called by QRpcPeer once the client cancels the request.
+     */
+    void cancel() const;
+
+    /**
+     * @brief current Return the context of the request currently being handled by the calling thread.
+     *
+     * Valid within typed handlers and methods of objects registered at a QRpcService.
+     */
+    static QRpcRequestContext current();
+
+    /**
+     * @brief Scope Make a context the current context of the calling thread during its lifetime.
+     */
+    class QTRPC_EXPORT Scope
+    {
+    public:
+        explicit Scope(const QRpcRequestContext& context);
+        ~Scope();
+        Scope(const Scope&) = delete;
+        Scope& operator=(const Scope&) = delete;
+
+    private:
+        const QRpcRequestContext* m_previous;
+    };
+
+private:
+    struct CancelState;
+
+    QDeadlineTimer m_deadline{QDeadlineTimer::Forever};
+    std::shared_ptr<CancelState> m_cancel;
+    const QRpcPeer* m_peer = nullptr;
+    std::uint64_t m_request_id = 0;
+};
+Q_DECLARE_METATYPE(QRpcRequestContext)
+
+
+/**
+ * @brief QRpcConcurrencyLimit Limit for requests processed concurrently, shared by any number of peers.
+ */
+class QTRPC_EXPORT QRpcConcurrencyLimit
+{
+public:
+    explicit QRpcConcurrencyLimit(int limit) : m_limit(limit) { }
+
+    int limit() const { return m_limit; }
+    int inFlight() const { return m_in_flight.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief tryAcquire Reserve a slot for processing a request.
+     * @return False if the limit is reached.
+     */
+    bool tryAcquire()
+    {
+        int n = m_in_flight.load(std::memory_order_relaxed);
+        do {
+            if (n >= m_limit) {
+                return false;
+            }
+        } while (!m_in_flight.compare_exchange_weak(n, n + 1, std::memory_order_relaxed));
+        return true;
+    }
+
+    /**
+     * @brief release Release slot reserved by tryAcquire(), waking up peers waiting for a slot.
+     */
+    void release();
+
+    /**
+     * @brief addWaiter Call function in the thread of a peer once the next slot is released.
+     *
+     * Used by QRpcPeer while requests are queued for a slot.
+     * @param peer Receiver of the wake-up, also identifying the waiter.
+     * @param wake Function called once in the thread of peer.
+     */
+    void addWaiter(QObject* peer, std::function<void()> wake);
+
+    /**
+     * @brief removeWaiter Stop waiting for a slot, e.g. when a peer is destroyed.
+     * @param peer Receiver passed to addWaiter().
+     */
+    void removeWaiter(QObject* peer);
+
+private:
+    const int m_limit;
+    std::atomic<int> m_in_flight{0};
+    QMutex m_mutex;
+    std::vector<std::pair<QObject*, std::function<void()>>> m_waiters;
+};
+
+
+/**
+ * @brief QRpcReceiveLimits Limits for messages received by a peer, see QRpcPeer::setReceiveLimits().
+ *
+ * A message exceeding a limit is an error in the data stream, closing the device. Arrays and
+ * maps are allocated before their items arrive, their limits bound the memory a message can
+ * claim ahead of its data. Lengths are reduced so that a single container never claims more
+ * than maxMessageSize. Lengths are not limited otherwise by default, peers receiving untrusted
+ * data may keep maxDepth nested containers within maxMessageSize by setting maxArrayLength to
+ * maxMessageSize / (maxDepth * sizeof(msgpack::object)) and maxMapLength to
+ * maxMessageSize / (maxDepth * sizeof(msgpack::object_kv)).
+ */
+struct QRpcReceiveLimits
+{
+    std::size_t maxMessageSize = 64 * 1024 * 1024;  ///< Bytes of a message, also after decompression.
+    std::size_t maxDepth = 32;                      ///< Nesting depth of arrays and maps.
+    std::size_t maxArrayLength = std::numeric_limits<std::size_t>::max();  ///< Items of an array.
+    std::size_t maxMapLength = std::numeric_limits<std::size_t>::max();    ///< Entries of a map.
+};
+
+
+/**
+ * @brief QRpcEncodedEvent Event serialized once for sending it to any number of peers.
+ *
+ * Large events are also compressed at most once, by the first peer sending them compressed.
+ */
+class QTRPC_EXPORT QRpcEncodedEvent
+{
+public:
+    /**
+     * @brief QRpcEncodedEvent Serialize event.
+     * @param name Event name.
+     * @param data Event data.
+     */
+    explicit QRpcEncodedEvent(const QString& name, const QVariant& data = QVariant());
+
+    /**
+     * @brief batch Serialize several emissions of an event into a single message.
+     *
+     * The receiving peer emits newEvent() for each item. Peers that did not announce support
+     * for event batches are sent each item as a separate event instead.
+     * @param name Event name.
+     * @param items Event data of each emission.
+     * @return Serialized event batch.
+     */
+    static QRpcEncodedEvent batch(const QString& name, const QVariantList& items);
+
+    const QString& name() const { return m_name; }
+    const QByteArray& frame() const { return m_frame; }
+
+private:
+    friend class QRpcPeer;
+    QRpcEncodedEvent() = default;
+
+    QString m_name;
+    QByteArray m_frame;
+    // Items of an event batch, sent one by one to peers not supporting batches
+    QVariantList m_items;
+    bool m_batch = false;
+    // Event name and start of the event data within the frame, for peers replacing names by integers
+    QByteArray m_name_utf8;
+    qsizetype m_payload_offset = 0;
+    // Compressed frame shared by all copies, for peers compressing large messages
+    struct CompressedFrame;
+    std::shared_ptr<CompressedFrame> m_compressed;
+};
+
+
 class QTRPC_EXPORT QRpcPeer : public QObject
 {
     Q_OBJECT
 
 public:
+    /**
+     * @brief WriteMode Strategy for handing outgoing messages to the IO device.
+     */
+    enum class WriteMode {
+        LowLatency,  ///< Write each message to the device as soon as it is serialized.
+        Throughput,  ///< Collect all messages of one event loop iteration and write them at once.
+    };
+    Q_ENUM(WriteMode)
+
+    /**
+     * @brief SlowConsumerPolicy Behavior once the write buffer exceeds its high watermark.
+     */
+    enum class SlowConsumerPolicy {
+        Buffer,      ///< Keep buffering, only notify via writeBufferFull().
+        Block,       ///< Stop reading from the remote peer until the buffer drained to the low watermark.
+        DropEvents,  ///< Drop outgoing events until the buffer drained to the low watermark.
+        Disconnect,  ///< Abort the connection.
+    };
+    Q_ENUM(SlowConsumerPolicy)
+
     /**
      * @brief QRpcPeer Create new QRpcPeer operating on existing IO device.
      * @param device IO device for reading/writing.
@@ -53,9 +403,35 @@ Q_SIGNALS:
      * @param args Request arguments.
      * @param resolve Request resolver.
      * @param reject Request rejecter.
+     * @param context Request context, e.g. with the deadline of the request.
      */
     void newRequest(const QString& method, const QVariant& args,
-                    const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject);
+                    const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject,
+                    const QRpcRequestContext& context);
+
+    /**
+     * @brief subscriptionsChanged Connected peer changed its event subscriptions.
+     * @param patterns Event name patterns the peer is subscribed to.
+     */
+    void subscriptionsChanged(const QStringList& patterns);
+
+    /**
+     * @brief blobReceived Received blob sent by QRpcPeer::sendFile() from connected peer.
+     * @param name Blob name.
+     * @param sink Device the blob was written to, see setBlobSinkFactory().
+     * @param error Error message, empty if the blob was received completely.
+     */
+    void blobReceived(const QString& name, QIODevice* sink, const QString& error);
+
+    /**
+     * @brief writeBufferFull Pending outgoing data exceeded the high watermark.
+     */
+    void writeBufferFull();
+
+    /**
+     * @brief writeBufferDrained Pending outgoing data fell below the low watermark again.
+     */
+    void writeBufferDrained();
 
 public Q_SLOTS:
     /**
@@ -78,20 +454,378 @@ public Q_SLOTS:
      */
     void sendEvent(const QString& name, const QVariant& data=QVariant());
 
+    /**
+     * @brief sendEvent Send pre-encoded event to peer.
+     * @param event Serialized event, see QRpcEncodedEvent.
+     */
+    void sendEvent(const QRpcEncodedEvent& event);
+
+    /**
+     * @brief subscribe Ask peer to send events with names matching any of the given patterns.
+     *
+     * Once subscribed, a QRpcService only sends events matching the subscriptions of the peer.
+     * @param patterns Event names or glob patterns such as "obj.*".
+     */
+    void subscribe(const QStringList& patterns);
+
+    /**
+     * @brief unsubscribe Remove patterns previously passed to subscribe().
+     * @param patterns Event name patterns.
+     */
+    void unsubscribe(const QStringList& patterns);
+
     /**
      * @brief device Return the QIODevice the rpc peer is operating on.
      * @return IO device.
      */
     QIODevice* device();
 
+    /**
+     * @brief setWriteMode Choose between low latency and high throughput writes.
+     * @param mode Write mode, defaults to WriteMode::LowLatency.
+     */
+    void setWriteMode(WriteMode mode);
+
+    /**
+     * @brief writeMode Return the current write mode.
+     * @return Write mode.
+     */
+    WriteMode writeMode() const;
+
+    /**
+     * @brief setHandlerRegistry Answer requests for methods with a registered handler directly.
+     *
+     * Requests for methods found in the registry are not emitted via newRequest().
+     * @param handlers Shared handler registry, nullptr to disable.
+     */
+    void setHandlerRegistry(std::shared_ptr<const QRpcHandlerRegistry> handlers);
+
+    /**
+     * @brief setZeroCopyDecoding Decode binary request and event data without copying.
+     *
+     * When enabled, binary values passed to newRequest() and newEvent() are QVariants holding
+     * msgpack::QtSharedBytes, which reference the received message and keep it alive for as long
+     * as they exist. Only binary data of at least 1 KiB references the received message, smaller
+     * data is copied while decoding and does not keep the message alive. Only methods taking
+     * msgpack::QtSharedBytes parameters avoid the copy, QByteArray parameters and converting the
+     * values to QByteArray copy the data.
+     * @param enabled Enable zero-copy decoding, disabled by default.
+     */
+    void setZeroCopyDecoding(bool enabled);
+
+    /**
+     * @brief zeroCopyDecoding Return whether zero-copy decoding is enabled.
+     */
+    bool zeroCopyDecoding() const;
+
+    /**
+     * @brief announceFeatures Negotiate protocol extensions with the remote peer.
+     *
+     * Announces name interning, event batches, compression and packed number arrays. Peers
+     * receiving the announcement reply with their own, extensions are used once the remote
+     * peer announced them. Peers not announcing features use the plain protocol, remaining
+     * compatible with implementations not knowing the announcement.
+     */
+    void announceFeatures();
+
+    /**
+     * @brief CompressionStats Counters of compressed outgoing messages, e.g. for tuning the threshold.
+     */
+    struct CompressionStats
+    {
+        quint64 compressedMessages = 0;    ///< Messages sent compressed.
+        quint64 uncompressedBytes = 0;     ///< Size of these messages before compression.
+        quint64 compressedBytes = 0;       ///< Size of these messages after compression.
+        quint64 incompressibleMessages = 0;  ///< Messages above the threshold not worth compressing.
+
+        quint64 bytesSaved() const { return uncompressedBytes - compressedBytes; }
+    };
+
+    /**
+     * @brief setCompressionThreshold Compress outgoing messages of at least the given size.
+     *
+     * Messages are compressed with zlib if the remote peer announced support for it, see
+     * announceFeatures(), and only sent compressed if that makes them smaller. Received compressed
+     * messages are always accepted.
+     * @param bytes Minimum message size for compression, 0 to disable compression (default).
+     */
+    void setCompressionThreshold(qint64 bytes);
+
+    /**
+     * @brief compressionThreshold Return the minimum size of messages sent compressed.
+     */
+    qint64 compressionThreshold() const;
+
+    /**
+     * @brief compressionStats Return counters of compressed outgoing messages.
+     */
+    CompressionStats compressionStats() const;
+
+    /**
+     * @brief setReceiveLimits Limit size and structure of received messages.
+     *
+     * New limits apply from the next message on if a message is partially received.
+     * @param limits Receive limits, see QRpcReceiveLimits for the defaults.
+     */
+    void setReceiveLimits(const QRpcReceiveLimits& limits);
+
+    /**
+     * @brief receiveLimits Return the limits for received messages.
+     */
+    QRpcReceiveLimits receiveLimits() const;
+
+    /**
+     * @brief setIdleTimeout Release buffer memory grown by large messages once the peer is idle.
+     *
+     * The peer is idle if no data was received or sent for the given time. Buffers holding
+     * partial messages are kept.
+     * @param timeout Idle time, 0 to keep buffers (default 30 s).
+     */
+    void setIdleTimeout(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief metrics Return counters of requests, bytes and latencies of this peer.
+     *
+     * Latencies are measured for received requests, from decoding the request until the
+     * response is in the write buffer. The snapshot may be taken from any thread.
+     */
+    QRpcPeerMetrics metrics() const;
+
+    /**
+     * @brief setWriteBufferWatermarks Configure thresholds for write buffer backpressure.
+     * @param low Pending bytes below which the buffer is considered drained.
+     * @param high Pending bytes above which the buffer is considered full.
+     */
+    void setWriteBufferWatermarks(qint64 low, qint64 high);
+
+    /**
+     * @brief writeBufferLowWatermark Return the low watermark in bytes.
+     */
+    qint64 writeBufferLowWatermark() const;
+
+    /**
+     * @brief writeBufferHighWatermark Return the high watermark in bytes.
+     */
+    qint64 writeBufferHighWatermark() const;
+
+    /**
+     * @brief bytesToWrite Return the number of outgoing bytes not yet written by the device.
+     * @return Pending bytes.
+     */
+    qint64 bytesToWrite() const;
+
+    /**
+     * @brief isWriteBufferFull Check if the high watermark was exceeded and not yet drained.
+     * @return True if producers should pause.
+     */
+    bool isWriteBufferFull() const;
+
+    /**
+     * @brief setSlowConsumerPolicy Choose how to handle peers not reading fast enough.
+     * @param policy Slow consumer policy, defaults to SlowConsumerPolicy::Buffer.
+     */
+    void setSlowConsumerPolicy(SlowConsumerPolicy policy);
+
+    /**
+     * @brief slowConsumerPolicy Return the current slow consumer policy.
+     */
+    SlowConsumerPolicy slowConsumerPolicy() const;
+
+    /**
+     * @brief setConcurrencyLimits Limit the number of received requests processed concurrently.
+     *
+     * Requests exceeding the limit are queued until a request finished. Requests exceeding the
+     * queue size are rejected with the error "Server overloaded". Requests answered by typed
+     * handlers are answered immediately and not limited.
+     * @param maxInFlight Maximum number of requests processed concurrently, 0 for no limit (default).
+     * @param maxQueued Maximum number of queued requests.
+     */
+    void setConcurrencyLimits(int maxInFlight, int maxQueued);
+
+    /**
+     * @brief setSharedConcurrencyLimit Additionally limit requests by a limit shared with other peers.
+     * @param limit Shared limit, nullptr for none.
+     */
+    void setSharedConcurrencyLimit(std::shared_ptr<QRpcConcurrencyLimit> limit);
+
+    /**
+     * @brief setPauseReadsWhenOverloaded Stop reading from the device while requests are queued.
+     *
+     * Messages received but not dispatched yet stay buffered until the queue is drained. Sockets
+     * stop receiving once their read buffer is full, which eventually stops the sender.
+     * @param enabled Pause reads while requests are queued, disabled by default.
+     */
+    void setPauseReadsWhenOverloaded(bool enabled);
+
+    /**
+     * @brief requestsInFlight Return the number of received requests being processed.
+     */
+    int requestsInFlight() const;
+
+    /**
+     * @brief requestsQueued Return the number of received requests waiting to be processed.
+     */
+    int requestsQueued() const;
+
+public:
+    using Request = std::pair<QString, QVariant>;
+
+    /**
+     * @brief sendRequests Send several requests to peer at once.
+     *
+     * If supported by the remote peer, the requests are sent in a single message and the
+     * remote peer answers them in a single message. Replies of requests taking longer than a
+     * short deadline are sent on their own once they finished.
+     * @param requests Request methods and argument(s).
+     * @return Promises fulfilled once the corresponding request finished.
+     */
+    std::vector<QRpcPromise> sendRequests(const std::vector<Request>& requests);
+
+    /**
+     * @brief sendRequest Send request to peer, rejecting it if no response arrived within timeout.
+     *
+     * The timeout is sent along with the request, allowing the remote peer to skip requests
+     * that are not answered in time.
+     * @param method Request method.
+     * @param arg Request argument(s).
+     * @param timeout Timeout, zero for waiting forever.
+     * @return Promise fulfilled once the request finished.
+     */
+    QRpcPromise sendRequest(const QString& method, const QVariant& arg, std::chrono::milliseconds timeout);
+
+    using ResponseCallback = std::function<void(const QVariant& result, const QString& error)>;
+
+    /**
+     * @brief sendRequest Send request to peer, calling a function once the request finished.
+     *
+     * Lightweight alternative to the promise-based overloads for high request rates. Apart from
+     * encoding the argument(s) and a callback exceeding the small buffer of std::function, sending
+     * the request and receiving its response does not allocate. The request uses the default
+     * timeout and cannot be canceled.
+     * @param method Request method.
+     * @param arg Request argument(s).
+     * @param callback Function called with the result, or with an error message if the request
+     * failed, timed out or the peer was destroyed before the response arrived.
+     */
+    void sendRequest(const QString& method, const QVariant& arg, ResponseCallback callback);
+
+    /**
+     * @brief setDefaultTimeout Set timeout for requests sent without explicit timeout.
+     * @param timeout Timeout, zero for waiting forever (default).
+     */
+    void setDefaultTimeout(std::chrono::milliseconds timeout);
+
+    /**
+     * @brief defaultTimeout Return the timeout for requests sent without explicit timeout.
+     */
+    std::chrono::milliseconds defaultTimeout() const;
+
+    /**
+     * @brief sendStreamRequest Send request to peer, receiving the result as stream of items.
+     *
+     * The remote method returns a QRpcStreamGenerator. The remote peer sends at most credits
+     * items not read from the stream yet, bounding the memory used by the stream on both ends.
+     * @param method Request method.
+     * @param arg Request argument(s).
+     * @param credits Number of items the remote peer may send ahead of the reader.
+     * @return Stream reader, canceling the request if destroyed before the stream finished.
+     */
+    std::unique_ptr<QRpcStreamReader> sendStreamRequest(const QString& method, const QVariant& arg = {},
+                                                        int credits = 64);
+
+    /**
+     * @brief sendFile Send file contents to peer in chunks, read from a memory mapping of the file.
+     *
+     * Chunks are handed to the device while the write buffer is below its high watermark,
+     * without copying the file to memory first. Files are sent one after another. The file must
+     * stay open until the returned promise finished.
+     * @param file Open file.
+     * @param name Name announced to the receiving peer, the file name by default.
+     * @return Promise fulfilled once the file was handed to the device.
+     */
+    QRpcPromise sendFile(QFile* file, const QString& name = {});
+
+    using BlobSinkFactory = std::function<QIODevice*(const QString& name, qint64 size)>;
+
+    /**
+     * @brief setBlobSinkFactory Set function providing devices for writing received blobs to.
+     *
+     * Chunks are written to the device as they arrive, blobReceived() is emitted at the end of
+     * the blob. The device is not owned by the peer. Blobs are discarded if the function returns
+     * nullptr or no function is set.
+     * @param factory Function returning an open device for a blob name and size.
+     */
+    void setBlobSinkFactory(BlobSinkFactory factory);
+
 private:
+    friend class QRpcStreamReader;
     class Private;
     std::unique_ptr<Private> p;
 };
 
 
+/**
+ * @brief QRpcStreamReader Items of a streamed response, see QRpcPeer::sendStreamRequest().
+ */
+class QTRPC_EXPORT QRpcStreamReader : public QObject
+{
+    Q_OBJECT
+
+public:
+    ~QRpcStreamReader() override;
+
+    /**
+     * @brief itemsAvailable Return the number of received items not read yet.
+     */
+    qsizetype itemsAvailable() const { return m_items.size(); }
+
+    /**
+     * @brief read Take received items, allowing the remote peer to send as many new items.
+     * @param maxItems Maximum number of items to read, -1 for all.
+     * @return Items in the order produced by the remote peer.
+     */
+    QVariantList read(qsizetype maxItems = -1);
+
+    /**
+     * @brief isFinished Return true if no more items will be received.
+     */
+    bool isFinished() const { return m_finished; }
+
+    /**
+     * @brief result Return promise fulfilled at the end of the stream or rejected on error.
+     */
+    QRpcPromise result() const { return m_result; }
+
+Q_SIGNALS:
+    /**
+     * @brief readyRead New items are available.
+     */
+    void readyRead();
+
+    /**
+     * @brief finished The stream ended, see result() for errors.
+     */
+    void finished();
+
+private:
+    friend class QRpcPeer;
+    friend class QRpcPeer::Private;
+    QRpcStreamReader(QRpcPeer* peer, std::uint64_t id, QRpcPromise result);
+
+    QPointer<QRpcPeer> m_peer;
+    std::uint64_t m_id;
+    QRpcPromise m_result;
+    QVariantList m_items;
+    bool m_finished = false;
+};
+
+
 /**
  * @brief QRpcRequestMap conveniently batches multiple requests and returns them as QVariantMap.
+ *
+ * Requests added by method name are collected and sent as a single batch once control returns
+ * to the event loop, or earlier when calling all() or wait() or when the map is destroyed.
+ * Remote peers that did not announce support for batches receive the requests one by one.
  */
 struct QTRPC_EXPORT QRpcRequestMap
 {
@@ -99,12 +833,19 @@ struct QTRPC_EXPORT QRpcRequestMap
      * @brief QRpcRequestMap Create request map for given peer.
      * @param peer RPC peer.
      * @param objname Objectname used as prefix for all requests.
+     * @param batched Send requests added by method name as one batch, or each immediately.
      */
-    QRpcRequestMap(QRpcPeer& peer, QString objname="")
+    QRpcRequestMap(QRpcPeer& peer, QString objname="", bool batched=true)
         : m_peer(peer)
         , m_objname(std::move(objname))
+        , m_batched(batched)
     { }
 
+    ~QRpcRequestMap()
+    {
+        sendPending(m_peer, *m_pending);
+    }
+
     /**
      * @brief add Add request to map using the given name.
      * @param name Key.
@@ -143,6 +884,7 @@ struct QTRPC_EXPORT QRpcRequestMap
      */
     QtPromise::QPromise<QVariantMap> all()
     {
+        sendPending(m_peer, *m_pending);
         auto p = QtPromise::all(m_requests);
         m_requests.clear();
         return p.then([keys=std::move(m_keys)](const QVector<QVariant>& vals) {
@@ -174,16 +916,57 @@ struct QTRPC_EXPORT QRpcRequestMap
     }
 
 private:
+    struct PendingRequest
+    {
+        QString method;
+        QRpcPromise::Resolve resolve;
+        QRpcPromise::Reject reject;
+    };
+
     inline QtPromise::QPromise<QVariant> makeRequest(const QString& method) {
-        return m_peer.sendRequest(
-            !m_objname.isEmpty() ? QStringLiteral("%1.%2").arg(m_objname, method) : method)
-        .then([](const QVariant& v) {
-            return v;
+        const QString fullMethod = !m_objname.isEmpty() ? QStringLiteral("%1.%2").arg(m_objname, method) : method;
+        if (!m_batched) {
+            return m_peer.sendRequest(fullMethod).then([](const QVariant& v) {
+                return v;
+            });
+        }
+        // Requests added before control returns to the event loop are sent together
+        if (m_pending->empty()) {
+            QTimer::singleShot(0, &m_peer, [peer = &m_peer, weak = std::weak_ptr(m_pending)]() {
+                if (auto pending = weak.lock()) {
+                    sendPending(*peer, *pending);
+                }
+            });
+        }
+        return QtPromise::QPromise<QVariant>([&](const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject) {
+            m_pending->push_back({fullMethod, resolve, reject});
         });
     }
 
+    static inline void sendPending(QRpcPeer& peer, std::vector<PendingRequest>& pending) {
+        if (pending.empty()) {
+            return;
+        }
+        std::vector<QRpcPeer::Request> requests;
+        requests.reserve(pending.size());
+        for (const auto& request: pending) {
+            requests.emplace_back(request.method, QVariant());
+        }
+        const auto promises = peer.sendRequests(requests);
+        for (std::size_t i = 0; i < promises.size(); ++i) {
+            promises[i].then([resolve = pending[i].resolve](const QVariant& v) {
+                resolve(v);
+            }).fail([reject = pending[i].reject]() {
+                reject(std::current_exception());
+            });
+        }
+        pending.clear();
+    }
+
     QRpcPeer& m_peer;
     QString m_objname;
+    bool m_batched;
     std::list<QString> m_keys;
     std::list<QtPromise::QPromise<QVariant>> m_requests;
+    std::shared_ptr<std::vector<PendingRequest>> m_pending = std::make_shared<std::vector<PendingRequest>>();
 };
@@ -1,10 +1,50 @@
 #pragma once
 #include <QtRpc_export.hpp>
+#include <QRpcHandler.hpp>
 #include <QRpcPeer.hpp>
+#include <QtCore/QHash>
+#include <QtCore/QMetaMethod>
 #include <QtCore/QObject>
+#include <QtCore/QPointer>
+#include <QtCore/QThread>
+#include <QtCore/QTimer>
 #include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
 #include <map>
-#include <set>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+/**
+ * @brief QRpcEventPolicy Forwarding policy for a signal of a registered object.
+ *
+ * Policies are passed to QRpcServiceBase::registerObject() or declared by the object class, e.g.
+ * `Q_CLASSINFO("QRpcEventPolicy:valueChanged", "latest;interval=20")` or
+ * `Q_CLASSINFO("QRpcEventPolicy:sampleReady", "batch;interval=100;size=64")`.
+ */
+struct QTRPC_EXPORT QRpcEventPolicy
+{
+    enum class Mode {
+        Immediate,  ///< Send each emission as event.
+        Latest,     ///< Send at most one emission per interval, the latest emission wins.
+        Batch,      ///< Collect emissions and send them as a single message per interval.
+    };
+
+    Mode mode = Mode::Immediate;
+    int interval = 0;      ///< Interval in milliseconds.
+    int maxBatchSize = 0;  ///< Send batch before the interval elapsed once it has this size, 0 for no limit.
+
+    static QRpcEventPolicy latest(int interval) { return {Mode::Latest, interval, 0}; }
+    static QRpcEventPolicy batch(int interval, int maxBatchSize = 0) { return {Mode::Batch, interval, maxBatchSize}; }
+
+    /**
+     * @brief fromString Parse policy from Q_CLASSINFO value.
+     * @param str Mode "immediate", "latest" or "batch", followed by options "interval=<ms>" and "size=<n>".
+     * @return Event policy, immediate if the string is invalid.
+     */
+    static QRpcEventPolicy fromString(QStringView str);
+};
 
 
 class QTRPC_EXPORT QRpcServiceBase : public QObject
@@ -14,9 +54,54 @@ class QTRPC_EXPORT QRpcServiceBase : public QObject
 public:
     ~QRpcServiceBase() override;
 
+    // Dispatch table entry compiled for each method of a registered object
+    struct RpcMethod;
+
+    /**
+     * @brief registerHandler Register a typed function for handling requests to a method.
+     *
+     * Arguments are decoded directly into the parameter types of the handler and its result
+     * is packed directly into the response, e.g.
+     * `service.registerHandler("obj.add", [](int a, double b) { return a + b; });`
+     * Typed handlers take precedence over methods of registered objects.
+     * @param method Full method name.
+     * @param handler Function, function pointer or non-generic lambda.
+     */
+    template <typename F>
+    void registerHandler(const QString& method, F&& handler)
+    {
+        registerRawHandler(method, makeRpcHandler(std::forward<F>(handler)));
+    }
+
+    /**
+     * @brief registerRawHandler Register a handler operating on undecoded request arguments.
+     * @param method Full method name.
+     * @param handler Request handler.
+     */
+    void registerRawHandler(const QString& method, QRpcHandler handler);
+
+    /**
+     * @brief unregisterHandler Remove a previously registered handler.
+     * @param method Full method name.
+     */
+    void unregisterHandler(const QString& method);
+
+    /**
+     * @brief registerObject Register a QObject with forwarding policies for its signals.
+     * @param name Name for routing RPC requests.
+     * @param o Object to be registered.
+     * @param eventPolicies Policies by signal name, overriding policies declared via Q_CLASSINFO.
+     */
+    void registerObject(const QString& name, QObject* o, const QHash<QString, QRpcEventPolicy>& eventPolicies);
+
 public Q_SLOTS:
     /**
      * @brief registerObject Register a QObject for dispatching received RPC requests to it.
+     *
+     * Methods are invoked in the thread of the object. Methods declared via
+     * `Q_CLASSINFO("QRpcMethodPolicy:<method>", "threadpool")` are invoked in the global
+     * QThreadPool instead and must be thread-safe. Names and objects can only be registered
+     * once, further registrations are ignored.
      * @param name Name for routing RPC requests.
      * @param o Object to be registered.
      */
@@ -34,16 +119,151 @@ public Q_SLOTS:
      */
     size_t numberOfPeers() { return m_peers.size(); }
 
+    /**
+     * @brief metrics Return the sum of the metrics of all connected peers.
+     */
+    QRpcPeerMetrics metrics() const;
+
+    /**
+     * @brief setStatsMethodEnabled Serve the metrics of all connected peers via the method "rpc.stats".
+     *
+     * The method returns a map with the number of peers and QRpcPeerMetrics::toVariantMap().
+     * @param enabled Serve "rpc.stats", disabled by default.
+     */
+    void setStatsMethodEnabled(bool enabled);
+
+    /**
+     * @brief setSlowConsumerPolicy Set the slow consumer policy for all current and future peers.
+     * @param policy Slow consumer policy.
+     */
+    void setSlowConsumerPolicy(QRpcPeer::SlowConsumerPolicy policy);
+
+    /**
+     * @brief setWriteBufferWatermarks Set write buffer watermarks for all current and future peers.
+     * @param low Low watermark in bytes.
+     * @param high High watermark in bytes.
+     */
+    void setWriteBufferWatermarks(qint64 low, qint64 high);
+
+    /**
+     * @brief setZeroCopyDecoding Enable zero-copy decoding of binary request arguments for all peers.
+     * @param enabled Enable zero-copy decoding, see QRpcPeer::setZeroCopyDecoding.
+     */
+    void setZeroCopyDecoding(bool enabled);
+
+    /**
+     * @brief setCompressionThreshold Compress large outgoing messages for all current and future peers.
+     * @param bytes Minimum message size for compression, see QRpcPeer::setCompressionThreshold.
+     */
+    void setCompressionThreshold(qint64 bytes);
+
+    /**
+     * @brief setSubscriptionRequired Only send events to peers that subscribed to them.
+     *
+     * By default, peers that never called QRpcPeer::subscribe() receive all events.
+     * @param required Require subscriptions for receiving events.
+     */
+    void setSubscriptionRequired(bool required);
+
+    /**
+     * @brief setWorkerThreads Serve new connections in a pool of worker threads.
+     *
+     * Connections are distributed round-robin over the worker threads, which decode requests and
+     * encode responses and events of their peers. Requests to registered objects are dispatched
+     * by the thread of the service, typed handlers are called in the worker thread of the peer.
+     * Connected peers stay in their thread when changing the number of threads.
+     * @param n Number of worker threads, 0 to serve all peers in the thread of the service.
+     */
+    void setWorkerThreads(int n);
+
+    /**
+     * @brief setConcurrencyLimits Limit the number of requests processed concurrently.
+     *
+     * Requests exceeding the limits are queued per peer, requests exceeding the queue are
+     * rejected with the error "Server overloaded", see QRpcPeer::setConcurrencyLimits.
+     * @param perPeerInFlight Maximum number of requests processed per peer, 0 for no limit.
+     * @param perPeerQueued Maximum number of requests queued per peer.
+     * @param globalInFlight Maximum number of requests processed for all peers, 0 for no limit.
+     */
+    void setConcurrencyLimits(int perPeerInFlight, int perPeerQueued, int globalInFlight = 0);
+
+    /**
+     * @brief setPauseReadsWhenOverloaded Stop reading from peers while their requests are queued.
+     * @param enabled Pause reads, see QRpcPeer::setPauseReadsWhenOverloaded.
+     */
+    void setPauseReadsWhenOverloaded(bool enabled);
+
+    /**
+     * @brief setReceiveLimits Limit size and structure of messages received from all peers.
+     * @param limits Receive limits, see QRpcPeer::setReceiveLimits.
+     */
+    void setReceiveLimits(const QRpcReceiveLimits& limits);
+
 protected:
+    // Peer and the thread serving it, only deleted by the service once removed from all routes
+    struct PeerHandle
+    {
+        QPointer<QRpcPeer> peer;
+        QPointer<QTcpSocket> socket;
+        QThread* thread = nullptr;
+    };
+
+    // Signal of a registered object and the peers subscribed to it
+    struct EventRoute
+    {
+        QString name;
+        QMetaMethod signal;
+        QMetaObject::Connection connection;
+        std::vector<PeerHandle> subscribers;
+        QRpcEventPolicy policy;
+        std::unique_ptr<QTimer> timer;
+        QVariantList pending;  // Conflated or batched emissions
+    };
+
     explicit QRpcServiceBase(QTcpServer* server, QObject* parent = nullptr);
 
     void handleNewRequest(const QString& method, const QVariant& args,
-                          const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject);
+                          const QRpcPromise::Resolve& resolve, const QRpcPromise::Reject& reject,
+                          const QRpcRequestContext& context);
+    void configurePeer(QRpcPeer* peer);
+    void updateEventRoutes();
+    void publishEvent(EventRoute& route, const QVariantList& args);
+    void flushEvent(EventRoute& route);
+    void sendEvent(const EventRoute& route, const QRpcEncodedEvent& event);
+    QObject* workerContext(QThread* thread) const;
+
+    // Worker thread with an object for running functions in its event loop
+    struct Worker
+    {
+        std::unique_ptr<QThread> thread;
+        QObject* context = nullptr;
+    };
 
     QTcpServer* m_server = nullptr;
     std::map<QString, QObject*> m_reg_name_to_obj;
     std::map<QObject*, QString> m_reg_obj_to_name;
-    std::set<QRpcPeer*> m_peers;
+    QHash<QString, std::shared_ptr<const RpcMethod>> m_methods;
+    std::shared_ptr<QRpcHandlerRegistry> m_handlers;
+    // Peers and their subscriptions by peer address, peers of worker threads are not dereferenced
+    // in the service thread except for their thread-safe metrics
+    std::map<QRpcPeer*, PeerHandle> m_peers;
+    std::map<std::pair<QObject*, int>, EventRoute> m_events;
+    std::map<QRpcPeer*, QStringList> m_subscriptions;
+    bool m_require_subscriptions = false;
+    std::vector<Worker> m_workers;
+    std::size_t m_active_workers = 0;
+    std::size_t m_next_worker = 0;
+    QRpcPeer::SlowConsumerPolicy m_slow_consumer_policy = QRpcPeer::SlowConsumerPolicy::Buffer;
+    qint64 m_low_watermark = -1;
+    qint64 m_high_watermark = -1;
+    bool m_zero_copy = false;
+    qint64 m_compression_threshold = 0;
+    bool m_stats_method = false;
+    int m_max_in_flight = 0;
+    int m_max_queued = 0;
+    std::shared_ptr<QRpcConcurrencyLimit> m_global_limit;
+    bool m_pause_reads = false;
+    QRpcReceiveLimits m_receive_limits;
 
 protected Q_SLOTS:
     void handleRegisteredObjectSignal();
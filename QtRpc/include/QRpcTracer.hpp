@@ -0,0 +1,83 @@
+#pragma once
+#include <QtRpc_export.hpp>
+#include <QtCore/QElapsedTimer>
+#include <QtCore/QFile>
+#include <QtCore/QHash>
+#include <QtCore/QMutex>
+#include <QtCore/QString>
+#include <QtCore/QStringView>
+#include <cstdint>
+
+class QRpcPeer;
+
+
+/**
+ * @brief QRpcTracer Receiver of events along the lifecycle of received requests.
+ *
+ * Events are only reported if QtRpc was built with QTRPC_ENABLE_TRACING, tracing has no
+ * cost otherwise. Events are reported from the threads of the peers and registered objects,
+ * implementations must be thread-safe.
+ */
+class QTRPC_EXPORT QRpcTracer
+{
+public:
+    enum class Stage {
+        BytesRead,       ///< Bytes read from the device, before decoding.
+        Decoded,         ///< Request decoded.
+        RequestEmitted,  ///< Request handed to QRpcPeer::newRequest().
+        MethodInvoked,   ///< Method of a registered object or typed handler about to be called.
+        Resolved,        ///< Request resolved or rejected.
+        ResponsePacked,  ///< Response or error written to the write buffer.
+        BytesFlushed,    ///< Bytes of the write buffer handed to the device.
+    };
+
+    struct Event
+    {
+        Stage stage;
+        const QRpcPeer* peer;  ///< Peer of the request, request ids are unique per peer.
+        std::uint64_t id;      ///< Request id, 0 for stages not related to a single request.
+        QStringView method;    ///< Method name, empty if not known at this stage.
+        qint64 bytes;          ///< Number of bytes for BytesRead and BytesFlushed.
+    };
+
+    virtual ~QRpcTracer() = default;
+
+    virtual void trace(const Event& event) = 0;
+
+    /**
+     * @brief install Set the tracer receiving the events of all peers.
+     * @param tracer Tracer, nullptr to stop tracing. The tracer is not owned and must outlive its use.
+     */
+    static void install(QRpcTracer* tracer);
+
+    /**
+     * @brief instance Return the installed tracer, or nullptr.
+     */
+    static QRpcTracer* instance();
+};
+
+
+/**
+ * @brief QRpcChromeTracer Tracer writing events to a file in Chrome trace event format.
+ *
+ * The file can be viewed with chrome://tracing or Perfetto. Each request is shown as async
+ * slice from decoding to packing the response, intermediate stages are shown as instants.
+ */
+class QTRPC_EXPORT QRpcChromeTracer : public QRpcTracer
+{
+public:
+    explicit QRpcChromeTracer(const QString& fileName);
+    ~QRpcChromeTracer() override;
+
+    bool isOpen() const { return m_file.isOpen(); }
+
+    void trace(const Event& event) override;
+
+private:
+    QMutex m_mutex;
+    QFile m_file;
+    QElapsedTimer m_timer;
+    bool m_first = true;
+    // Method names of the requests in progress, keyed by peer and request id
+    QHash<QString, QString> m_methods;
+};
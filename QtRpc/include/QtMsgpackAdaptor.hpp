@@ -0,0 +1,428 @@
+#pragma once
+#include <QtCore/QDebug>
+#include <QtCore/QVariant>
+#include <QtCore/QString>
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QtEndian>
+#ifdef QTMSGPACK_ADAPTER_WITH_QML
+#include <QtQml/QJSValue>
+#endif
+#include <msgpack.hpp>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace msgpack {
+
+struct QByteArrayBuffer
+{
+    QByteArrayBuffer() = default;
+    operator QByteArray&() { return buffer; }
+    operator const QByteArray&() const { return buffer; }
+    QByteArray* operator->() { return &buffer; }
+    void write(const char* data, const size_t sz)
+    {
+        buffer.append(data, static_cast<int>(sz));
+    }
+private:
+    QByteArray buffer;
+};
+
+/**
+ * Binary data referencing an unpacked message instead of a copy of it. Each
+ * copy shares ownership of the message, keeping its data valid for as long
+ * as any copy exists, also in other threads.
+ */
+class QtSharedBytes
+{
+public:
+    QtSharedBytes() = default;
+    QtSharedBytes(const char* data, qsizetype size, std::shared_ptr<const void> owner)
+        : m_data(data), m_size(size), m_owner(std::move(owner)) { }
+    explicit QtSharedBytes(QByteArray data)
+    {
+        auto owner = std::make_shared<const QByteArray>(std::move(data));
+        m_data = owner->constData();
+        m_size = owner->size();
+        m_owner = std::move(owner);
+    }
+
+    const char* constData() const { return m_data; }
+    qsizetype size() const { return m_size; }
+    bool isEmpty() const { return m_size == 0; }
+
+    // Array referencing the data, only valid as long as this object exists
+    QByteArray view() const { return QByteArray::fromRawData(m_data, m_size); }
+    QByteArray toByteArray() const { return QByteArray(m_data, m_size); }
+
+    bool operator==(const QtSharedBytes& other) const { return view() == other.view(); }
+
+private:
+    const char* m_data = nullptr;
+    qsizetype m_size = 0;
+    std::shared_ptr<const void> m_owner;
+};
+
+/**
+ * Scoped opt-in for decoding BIN objects held by QVariants as QtSharedBytes
+ * referencing the unpacked data instead of copying it. Values share the
+ * owner, e.g. the object_handle of the message, which is only retained once
+ * data of at least minSize bytes is referenced. Smaller data is copied.
+ * Decoding to QByteArray always copies, only QtSharedBytes avoid the copy.
+ */
+class QtZeroCopyScope
+{
+public:
+    using Retain = std::function<std::shared_ptr<const void>()>;
+
+    explicit QtZeroCopyScope(std::shared_ptr<const void> owner)
+        : QtZeroCopyScope(owner ? Retain([owner]() { return owner; }) : Retain()) { }
+    explicit QtZeroCopyScope(Retain retain, std::size_t minSize = 0)
+        : m_retain(std::move(retain)), m_min_size(minSize), m_previous(std::exchange(s_current, this)) { }
+    ~QtZeroCopyScope() { s_current = m_previous; }
+    QtZeroCopyScope(const QtZeroCopyScope&) = delete;
+    QtZeroCopyScope& operator=(const QtZeroCopyScope&) = delete;
+
+    static bool isEnabled() { return s_current && s_current->m_retain; }
+    static bool references(std::size_t size) { return isEnabled() && size >= s_current->m_min_size; }
+    static const std::shared_ptr<const void>& owner()
+    {
+        if (!s_current->m_owner) {
+            s_current->m_owner = s_current->m_retain();
+        }
+        return s_current->m_owner;
+    }
+
+private:
+    static inline thread_local QtZeroCopyScope* s_current = nullptr;
+    Retain m_retain;
+    std::size_t m_min_size;
+    std::shared_ptr<const void> m_owner;
+    QtZeroCopyScope* m_previous;
+};
+
+/**
+ * Scoped opt-in for packing lists of numbers, e.g. QList<double>, as ext
+ * objects carrying the values as contiguous little-endian data. Only enable
+ * it for receivers knowing these ext types, lists are packed as plain arrays
+ * of numbers otherwise. Packed arrays are always accepted when unpacking.
+ */
+class QtTypedArrayScope
+{
+public:
+    explicit QtTypedArrayScope(bool enabled = true) : m_previous(s_enabled) { s_enabled = enabled; }
+    ~QtTypedArrayScope() { s_enabled = m_previous; }
+    QtTypedArrayScope(const QtTypedArrayScope&) = delete;
+    QtTypedArrayScope& operator=(const QtTypedArrayScope&) = delete;
+
+    static bool isEnabled() { return s_enabled; }
+
+private:
+    static inline thread_local bool s_enabled = false;
+    bool m_previous;
+};
+
+/**
+ * Ext type of packed arrays for each element type.
+ */
+template <typename T> struct QtTypedArray { static constexpr std::int8_t type = -1; };
+template <> struct QtTypedArray<qint8> { static constexpr std::int8_t type = 0x10; };
+template <> struct QtTypedArray<quint8> { static constexpr std::int8_t type = 0x11; };
+template <> struct QtTypedArray<qint16> { static constexpr std::int8_t type = 0x12; };
+template <> struct QtTypedArray<quint16> { static constexpr std::int8_t type = 0x13; };
+template <> struct QtTypedArray<qint32> { static constexpr std::int8_t type = 0x14; };
+template <> struct QtTypedArray<quint32> { static constexpr std::int8_t type = 0x15; };
+template <> struct QtTypedArray<qint64> { static constexpr std::int8_t type = 0x16; };
+template <> struct QtTypedArray<quint64> { static constexpr std::int8_t type = 0x17; };
+template <> struct QtTypedArray<float> { static constexpr std::int8_t type = 0x18; };
+template <> struct QtTypedArray<double> { static constexpr std::int8_t type = 0x19; };
+
+template <typename T>
+inline constexpr bool isQtTypedArrayElement = QtTypedArray<T>::type >= 0;
+
+MSGPACK_API_VERSION_NAMESPACE(MSGPACK_DEFAULT_API_NS) {
+namespace adaptor {
+
+template <typename T> struct pack<QList<T>, std::enable_if_t<isQtTypedArrayElement<T>>> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, QList<T> const& v) const {
+        if (!QtTypedArrayScope::isEnabled()) {
+            o.pack_array(static_cast<uint32_t>(v.size()));
+            for (const T value: v) {
+                o.pack(value);
+            }
+            return o;
+        }
+        const auto n_bytes = static_cast<uint32_t>(static_cast<std::size_t>(v.size()) * sizeof(T));
+        o.pack_ext(n_bytes, QtTypedArray<T>::type);
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+        o.pack_ext_body(reinterpret_cast<const char*>(v.constData()), n_bytes);
+#else
+        QList<T> le(v.size());
+        qToLittleEndian<T>(v.constData(), v.size(), le.data());
+        o.pack_ext_body(reinterpret_cast<const char*>(le.constData()), n_bytes);
+#endif
+        return o;
+    }
+};
+
+template <typename T> struct convert<QList<T>, std::enable_if_t<isQtTypedArrayElement<T>>> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QList<T>& v) const {
+        if (o.type == msgpack::type::ARRAY) {
+            // Lists packed by peers not supporting packed arrays
+            v.clear();
+            v.reserve(o.via.array.size);
+            for (uint32_t i = 0; i < o.via.array.size; ++i) {
+                v.append(o.via.array.ptr[i].as<T>());
+            }
+            return o;
+        }
+        if (o.type != msgpack::type::EXT || o.via.ext.type() != QtTypedArray<T>::type
+                || o.via.ext.size % sizeof(T) != 0) {
+            throw msgpack::type_error();
+        }
+        // Single copy of the data, swapping bytes on big-endian hosts only
+        v.resize(static_cast<qsizetype>(o.via.ext.size / sizeof(T)));
+        qFromLittleEndian<T>(o.via.ext.data(), v.size(), v.data());
+        return o;
+    }
+};
+
+// Pack QVariant holding a list of one of the given element types, returns false for other values
+template <typename Stream, typename... T>
+inline bool packQtTypedArray(msgpack::packer<Stream>& o, QVariant const& v) {
+    return ((v.metaType() == QMetaType::fromType<QList<T>>()
+             && (o.pack(*static_cast<const QList<T>*>(v.constData())), true)) || ...);
+}
+
+// Convert packed array to QVariant holding a list of one of the given element types
+template <typename... T>
+inline bool convertQtTypedArray(msgpack::object const& o, QVariant& v) {
+    return ((o.via.ext.type() == QtTypedArray<T>::type && (v.setValue(o.as<QList<T>>()), true)) || ...);
+}
+
+template<> struct pack<QtSharedBytes> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, QtSharedBytes const& v) const {
+        o.pack_bin(static_cast<uint32_t>(v.size()));
+        o.pack_bin_body(v.constData(), static_cast<uint32_t>(v.size()));
+        return o;
+    }
+};
+
+template<> struct convert<QtSharedBytes> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QtSharedBytes& v) const {
+        if (o.type != msgpack::type::BIN) {
+            throw msgpack::type_error();
+        }
+        if (QtZeroCopyScope::references(o.via.bin.size)) {
+            // Reference unpacked data, keeping the message alive
+            v = QtSharedBytes(o.via.bin.ptr, static_cast<qsizetype>(o.via.bin.size), QtZeroCopyScope::owner());
+        } else {
+            v = QtSharedBytes(QByteArray(o.via.bin.ptr, static_cast<qsizetype>(o.via.bin.size)));
+        }
+        return o;
+    }
+};
+
+template<> struct pack<QVariant> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, QVariant const& v) const {
+        const auto valueType = v.metaType();
+        switch (valueType.id()) {
+        case QMetaType::UnknownType:
+        case QMetaType::Void:
+            return o.pack_nil();
+        case QMetaType::Bool:
+            return o.pack(v.toBool());
+        case QMetaType::Char:
+        case QMetaType::Short:
+        case QMetaType::Int:
+            return o.pack(v.toInt());
+        case QMetaType::UChar:
+        case QMetaType::UShort:
+        case QMetaType::UInt:
+            return o.pack(v.toUInt());
+        case QMetaType::Long:
+        case QMetaType::LongLong:
+            return o.pack(v.toLongLong());
+        case QMetaType::ULong:
+        case QMetaType::ULongLong:
+            return o.pack(v.toULongLong());
+        case QMetaType::Float:
+        case QMetaType::Double:
+            return o.pack(v.toDouble());
+        case QMetaType::QVariantList:
+        {
+            const QList<QVariant> list = v.toList();
+            o.pack_array(list.size());
+            for (const auto& value: list) {
+                o.pack(value);
+            }
+            return o;
+        }
+        break;
+        case QMetaType::QVariantMap:
+            return o.pack(v.toMap());
+        case QMetaType::QString:
+            return o.pack(v.toString());
+        case QMetaType::QStringList:
+        {
+            const QStringList list = v.toStringList();
+            o.pack_array(list.size());
+            for (const auto& value: list) {
+                o.pack(value);
+            }
+            return o;
+        }
+        case QMetaType::QByteArray:
+            return o.pack(v.toByteArray());
+        }
+        if (valueType == QMetaType::fromType<QtSharedBytes>()) {
+            return o.pack(*static_cast<const QtSharedBytes*>(v.constData()));
+        }
+        // Lists of numbers, packed arrays if enabled
+        if (packQtTypedArray<Stream, qint8, quint8, qint16, quint16, qint32, quint32, qint64, quint64, float, double>(
+                o, v)) {
+            return o;
+        }
+        // Additional runtime dependent types
+#ifdef QTMSGPACK_ADAPTER_WITH_QML
+        if (valueType == QMetaType::fromType<QJSValue>()) {
+            return o.pack(reinterpret_cast<const QJSValue*>(v.data())->toVariant());
+        }
+#endif
+        // Failed to serialize value, print warning and pack null
+        qWarning() << "qtmsgpackadaptor: no conversion for" << valueType.name();
+        return o.pack_nil();
+    }
+};
+
+template<> struct convert<QVariant> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QVariant& v) const {
+        switch (o.type) {
+        case msgpack::type::NIL:
+            v.setValue(nullptr);
+            break;
+        case msgpack::type::BOOLEAN:
+            v.setValue(o.as<bool>());
+            break;
+        case msgpack::type::FLOAT:
+            v.setValue(o.as<double>());
+            break;
+        case msgpack::type::POSITIVE_INTEGER:
+            v.setValue(o.as<qulonglong>());
+            break;
+        case msgpack::type::NEGATIVE_INTEGER:
+            v.setValue(o.as<qlonglong>());
+            break;
+        case msgpack::type::STR:
+            v.setValue(o.as<QString>());
+            break;
+        case msgpack::type::BIN:
+            if (QtZeroCopyScope::isEnabled()) {
+                v.setValue(o.as<QtSharedBytes>());
+            } else {
+                v.setValue(o.as<QByteArray>());
+            }
+            break;
+        case msgpack::type::ARRAY:
+        {
+            QVariantList list;
+            for (unsigned int i = 0; i < o.via.array.size; ++i) {
+                list << o.via.array.ptr[i].as<QVariant>();
+            }
+            v.setValue(list);
+        }
+        break;
+        case msgpack::type::MAP:
+        {
+            v.setValue(o.as<QVariantMap>());
+        }
+        break;
+        case msgpack::type::EXT:
+            // Packed arrays, other ext types are not supported
+            convertQtTypedArray<qint8, quint8, qint16, quint16, qint32, quint32, qint64, quint64, float, double>(o, v);
+            break;
+        default:
+            break;
+        }
+        return o;
+    }
+};
+
+template<> struct pack<QString> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, QString const& v) const {
+        const QByteArray encoded = v.toUtf8();
+        o.pack_str(encoded.size());
+        o.pack_str_body(encoded.data(), encoded.size());
+        return o;
+    }
+};
+
+template<> struct convert<QString> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QString& v) const {
+        if (o.type != msgpack::type::STR && o.type != msgpack::type::BIN) {
+            throw msgpack::type_error();
+        }
+        v = QString::fromUtf8(o.via.str.ptr, static_cast<int>(o.via.str.size));  // UTF-16 conversion always copies
+        return o;
+    }
+};
+
+template<> struct pack<QByteArray> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, QByteArray const& v) const {
+        o.pack_bin(v.size());
+        o.pack_bin_body(v.data(), v.size());
+        return o;
+    }
+};
+
+template<> struct convert<QByteArray> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QByteArray& v) const {
+        if (o.type != msgpack::type::BIN) {
+            throw msgpack::type_error();
+        }
+        v = QByteArray(o.via.bin.ptr, static_cast<int>(o.via.bin.size));
+        return o;
+    }
+};
+
+template<> struct pack<QVariantMap> {
+    template <typename Stream>
+    inline packer<Stream>& operator()(msgpack::packer<Stream>& o, const QVariantMap& map) const {
+        QMap<QString, QVariant>::const_iterator it = map.constBegin();
+        o.pack_map(map.size());
+        while (it != map.constEnd()) {
+            o.pack(it.key());
+            o.pack(it.value());
+            ++it;
+        }
+        return o;
+    }
+};
+
+template<> struct convert<QVariantMap> {
+    inline msgpack::object const& operator()(msgpack::object const& o, QVariantMap& map) const {
+        if (o.type != msgpack::type::MAP) {
+            throw msgpack::type_error();
+        }
+        for (unsigned int i = 0; i < o.via.map.size; ++i) {
+            QString key(o.via.map.ptr[i].key.as<QString>());
+            QVariant val(o.via.map.ptr[i].val.as<QVariant>());
+            map.insert(key, val);
+        }
+        return o;
+    }
+};
+
+}  // namespace adaptor
+}  // namespace msgpack version
+}  // namespace msgpack
+
+Q_DECLARE_METATYPE(msgpack::QtSharedBytes)
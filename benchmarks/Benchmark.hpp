@@ -0,0 +1,40 @@
+#pragma once
+#include <QtCore/QElapsedTimer>
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+
+
+// Number of heap allocations made by the process, counted by Benchmark.cpp
+extern std::atomic<std::uint64_t> g_n_allocations;
+
+
+/**
+ * @brief runBenchmark Repeatedly call a function and print the timing as one JSON object per line.
+ * @param name Benchmark name.
+ * @param ops Number of operations performed by a single call of fn.
+ * @param fn Function to benchmark.
+ * @param minTimeMs Minimum total run time in milliseconds.
+ */
+template <typename F>
+inline void runBenchmark(const char* name, std::int64_t ops, F&& fn, std::int64_t minTimeMs = 500)
+{
+    // Warm up caches and allocator before measuring
+    fn();
+
+    QElapsedTimer timer;
+    std::int64_t iterations = 0;
+    const auto allocations = g_n_allocations.load(std::memory_order_relaxed);
+    timer.start();
+    do {
+        fn();
+        ++iterations;
+    } while (timer.elapsed() < minTimeMs);
+    const auto ns = static_cast<double>(timer.nsecsElapsed());
+    const auto n_allocs = static_cast<double>(g_n_allocations.load(std::memory_order_relaxed) - allocations);
+    const auto n_ops = static_cast<double>(iterations * ops);
+
+    std::printf("{\"name\": \"%s\", \"ns_per_op\": %.1f, \"ops_per_sec\": %.0f, \"allocs_per_op\": %.2f}\n",
+                name, ns / n_ops, n_ops * 1e9 / ns, n_allocs / n_ops);
+    std::fflush(stdout);
+}
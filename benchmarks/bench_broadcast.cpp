@@ -0,0 +1,68 @@
+#include "Benchmark.hpp"
+#include <QRpcPeer.hpp>
+#include <QtCore/QBuffer>
+#include <QtCore/QCoreApplication>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief PeerSet Peers writing to in-memory devices, standing in for connected clients.
+ */
+struct PeerSet
+{
+    explicit PeerSet(int n_peers)
+    {
+        for (int i = 0; i < n_peers; ++i) {
+            auto device = std::make_unique<QBuffer>();
+            device->open(QIODevice::WriteOnly);
+            peers.push_back(std::make_unique<QRpcPeer>(device.get()));
+            devices.push_back(std::move(device));
+        }
+    }
+
+    // Rewind devices and process pending device notifications
+    void reset()
+    {
+        for (auto& device: devices) {
+            device->seek(0);
+        }
+        QCoreApplication::processEvents();
+    }
+
+    std::vector<std::unique_ptr<QBuffer>> devices;
+    std::vector<std::unique_ptr<QRpcPeer>> peers;
+};
+
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    const QString name = QStringLiteral("obj.valueChanged");
+    const QVariantList args{42, 3.14, QStringLiteral("value"), QVariantMap{{"a", 1}, {"b", 2.5}}};
+
+    for (int n_peers: {1, 10, 100, 1000}) {
+        PeerSet set(n_peers);
+
+        // Event fan-out serializing the event for every peer
+        const auto perPeerName = "broadcast/encode_per_peer/" + std::to_string(n_peers);
+        runBenchmark(perPeerName.c_str(), 1, [&]() {
+            for (auto& peer: set.peers) {
+                peer->sendEvent(name, args);
+            }
+            set.reset();
+        });
+
+        // Event fan-out serializing the event once
+        const auto onceName = "broadcast/encode_once/" + std::to_string(n_peers);
+        runBenchmark(onceName.c_str(), 1, [&]() {
+            const QRpcEncodedEvent event(name, args);
+            for (auto& peer: set.peers) {
+                peer->sendEvent(event);
+            }
+            set.reset();
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,95 @@
+#include "Benchmark.hpp"
+#include "QtMsgpackAdaptor.hpp"
+#include <QtCore/QByteArray>
+#include <QtCore/QList>
+#include <QtCore/QString>
+#include <QtCore/QVariant>
+#include <cstdint>
+#include <memory>
+#include <utility>
+#include <vector>
+
+
+// Telemetry-like map with repeated keys and nested lists and maps
+static QVariant makeNested()
+{
+    QVariantList channels;
+    for (int i = 0; i < 16; ++i) {
+        channels.append(QVariantMap{
+            {"name", QString("channel%1").arg(i)},
+            {"enabled", i % 2 == 0},
+            {"gain", 1.5 * i},
+            {"samples", QVariantList{i, i + 1, i + 2, i + 3}},
+        });
+    }
+    return QVariantMap{{"timestamp", 1234567890}, {"device", "sensor"}, {"channels", channels}};
+}
+
+static msgpack::sbuffer packed(const QVariant& v)
+{
+    msgpack::sbuffer buffer;
+    msgpack::pack(buffer, v);
+    return buffer;
+}
+
+
+int main()
+{
+    const std::vector<std::pair<const char*, QVariant>> payloads{
+        {"scalar", QVariant(42)},
+        {"string", QVariant(QString("The quick brown fox jumps over the lazy dog"))},
+        {"nested", makeNested()},
+        {"bytearray_1mb", QVariant(QByteArray(1024 * 1024, 'x'))},
+        {"waveform_64k", QVariant::fromValue(QList<double>(64 * 1024, 0.5))},
+    };
+
+    // Serialization into a reused buffer, as done for each outgoing message
+    msgpack::sbuffer buffer;
+    for (const auto& payload: payloads) {
+        const auto benchmark = QByteArray("pack/") + payload.first;
+        runBenchmark(benchmark.constData(), 1, [&]() {
+            buffer.clear();
+            msgpack::pack(buffer, payload.second);
+        });
+    }
+    const auto& waveform = payloads.back().second;
+    runBenchmark("pack/waveform_64k/typed", 1, [&]() {
+        msgpack::QtTypedArrayScope typedArrays;
+        buffer.clear();
+        msgpack::pack(buffer, waveform);
+    });
+
+    // Deserialization from objects unpacked beforehand, as done for each incoming message
+    for (const auto& payload: payloads) {
+        const auto data = packed(payload.second);
+        const auto handle = std::make_shared<msgpack::object_handle>(msgpack::unpack(data.data(), data.size()));
+        const msgpack::object& obj = handle->get();
+        const auto benchmark = QByteArray("convert/") + payload.first;
+        runBenchmark(benchmark.constData(), 1, [&]() {
+            const auto v = obj.as<QVariant>();
+            Q_UNUSED(v);
+        });
+        const auto benchmarkZeroCopy = benchmark + "/zerocopy";
+        runBenchmark(benchmarkZeroCopy.constData(), 1, [&]() {
+            msgpack::QtZeroCopyScope zeroCopy(handle);
+            const auto v = obj.as<QVariant>();
+            Q_UNUSED(v);
+        });
+    }
+    {
+        // Packed array decoded by a single copy into the list
+        msgpack::sbuffer data;
+        {
+            msgpack::QtTypedArrayScope typedArrays;
+            msgpack::pack(data, waveform);
+        }
+        const auto handle = msgpack::unpack(data.data(), data.size());
+        const msgpack::object& obj = handle.get();
+        runBenchmark("convert/waveform_64k/typed", 1, [&]() {
+            const auto v = obj.as<QVariant>();
+            Q_UNUSED(v);
+        });
+    }
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include "Benchmark.hpp"
+#include "MsgpackRpcProtocol.hpp"
+#include "QtMsgpackAdaptor.hpp"
+#include <QtCore/QByteArray>
+#include <QtCore/QString>
+#include <QtCore/QVariant>
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+
+/**
+ * @brief RecordedStream Input stream replaying previously recorded data.
+ */
+struct RecordedStream
+{
+    QByteArray data;
+    qint64 pos = 0;
+
+    qint64 bytesAvailable() const { return data.size() - pos; }
+
+    qint64 read(char* dst, qint64 n)
+    {
+        n = std::min(n, bytesAvailable());
+        std::memcpy(dst, data.constData() + pos, static_cast<std::size_t>(n));
+        pos += n;
+        return n;
+    }
+
+    void rewind() { pos = 0; }
+};
+
+/**
+ * @brief RecordingStream Output stream collecting all written data.
+ */
+struct RecordingStream
+{
+    QByteArray data;
+
+    void write(const char* p, qint64 n) { data.append(p, static_cast<qsizetype>(n)); }
+};
+
+/**
+ * @brief NameHandler Protocol handler converting names to QString like QRpcPeer does.
+ */
+struct NameHandler
+{
+    std::uint64_t n_requests = 0;
+    std::uint64_t n_events = 0;
+
+    void handleRequest(std::string_view method, const msgpack::object&, std::uint64_t,
+                       const MsgpackRpcMessage::RequestOptions&)
+    {
+        const auto name = QString::fromUtf8(method.data(), static_cast<qsizetype>(method.size()));
+        n_requests += name.isEmpty() ? 0 : 1;
+    }
+    void handleResponse(std::uint64_t, const msgpack::object&) { }
+    void handleError(std::uint64_t, std::string_view) { }
+    void handleCancel(std::uint64_t) { }
+    void handleStreamItems(std::uint64_t, const msgpack::object&) { }
+    void handleStreamCredit(std::uint64_t, std::uint64_t) { }
+    void handleBlobBegin(std::uint64_t, std::string_view, std::uint64_t) { }
+    void handleBlobChunk(std::uint64_t, const char*, std::size_t) { }
+    void handleBlobEnd(std::uint64_t, std::string_view) { }
+    void handleEvent(std::string_view, const msgpack::object& o)
+    {
+        const auto v = o.as<QVariant>();
+        n_events += v.isValid() ? 1 : 0;
+    }
+    void handleEventBatch(std::string_view, const msgpack::object&) { }
+    void handleSubscription(bool, const msgpack::object&) { }
+    void handleHello() { }
+    void beginBatch() { }
+    void endBatch() { }
+};
+
+using Protocol = MsgpackRpcProtocol<RecordedStream, RecordingStream, NameHandler>;
+
+
+static QByteArray recordSmallRequests(int n)
+{
+    RecordedStream in;
+    RecordingStream out;
+    NameHandler handler;
+    Protocol protocol(in, out, handler);
+    for (int i = 0; i < n; ++i) {
+        protocol.sendRequest("obj.method1", QVariant(QVariantList{1, 2}), static_cast<std::uint64_t>(i + 1));
+    }
+    return out.data;
+}
+
+static QByteArray recordNestedEvents(int n)
+{
+    QVariantList channels;
+    for (int i = 0; i < 16; ++i) {
+        channels.append(QVariantMap{{"name", QString("channel%1").arg(i)}, {"gain", 1.5 * i},
+                                    {"samples", QVariantList{i, i + 1, i + 2, i + 3}}});
+    }
+    const QVariant data = QVariantMap{{"timestamp", 1234567890}, {"channels", channels}};
+
+    RecordedStream in;
+    RecordingStream out;
+    NameHandler handler;
+    Protocol protocol(in, out, handler);
+    for (int i = 0; i < n; ++i) {
+        protocol.sendEvent("obj.telemetry", data);
+    }
+    return out.data;
+}
+
+// Message parsing prior to in-place decoding, kept as reference for comparison
+static void legacyReadAvailableBytes(RecordedStream& in, msgpack::unpacker& unpacker, NameHandler& handler)
+{
+    auto n_avail = in.bytesAvailable();
+    unpacker.reserve_buffer(static_cast<std::size_t>(n_avail));
+    auto n_read = in.read(unpacker.buffer(), n_avail);
+    unpacker.buffer_consumed(static_cast<std::size_t>(n_read));
+
+    msgpack::unpacked unpacked;
+    while (unpacker.next(unpacked)) {
+        std::vector<msgpack::object> message;
+        unpacked.get().convert(message);
+        if (message.at(0).as<std::uint8_t>() == 1) {
+            const auto method = message.at(1).as<std::string>();
+            const auto name = QString::fromStdString(method);
+            handler.n_requests += name.isEmpty() ? 0 : 1;
+        }
+    }
+}
+
+
+int main()
+{
+    constexpr int n_messages = 1000;
+    RecordedStream in{recordSmallRequests(n_messages)};
+    RecordingStream out;
+    NameHandler handler;
+
+    msgpack::unpacker unpacker;
+    runBenchmark("read_small_requests/legacy", n_messages, [&]() {
+        in.rewind();
+        legacyReadAvailableBytes(in, unpacker, handler);
+    });
+
+    Protocol protocol(in, out, handler);
+    runBenchmark("read_small_requests/inplace", n_messages, [&]() {
+        in.rewind();
+        protocol.readAvailableBytes();
+    });
+
+    constexpr int n_events = 100;
+    RecordedStream events{recordNestedEvents(n_events)};
+    Protocol eventProtocol(events, out, handler);
+    runBenchmark("read_nested_events/inplace", n_events, [&]() {
+        events.rewind();
+        eventProtocol.readAvailableBytes();
+    });
+
+    return (handler.n_requests > 0 && handler.n_events > 0) ? 0 : 1;
+}
@@ -0,0 +1,57 @@
+#include "Benchmark.hpp"
+#include <QRpcPeer.hpp>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEventLoop>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    QTcpServer server;
+    server.listen(QHostAddress::LocalHost);
+    QTcpSocket socket;
+    socket.connectToHost(server.serverAddress(), server.serverPort());
+    socket.waitForConnected();
+    server.waitForNewConnection(1000);
+    QRpcPeer client(&socket);
+    QRpcPeer echo(server.nextPendingConnection());
+    QObject::connect(&echo, &QRpcPeer::newRequest, &echo,
+                     [](const QString&, const QVariant& args, const QRpcPromise::Resolve& resolve,
+                        const QRpcPromise::Reject&, const QRpcRequestContext&) {
+        resolve(args);
+    });
+
+    constexpr int n_requests = 100;
+    const QString method = QStringLiteral("echo");
+    const QVariant arg(42);
+    QEventLoop loop;
+
+    // Responses delivered by resolving a promise per request
+    runBenchmark("requests/promise", n_requests, [&]() {
+        int remaining = n_requests;
+        for (int i = 0; i < n_requests; ++i) {
+            client.sendRequest(method, arg).then([&](const QVariant&) {
+                if (--remaining == 0) {
+                    loop.quit();
+                }
+            });
+        }
+        loop.exec();
+    });
+
+    // Responses delivered to a callback, without promise state
+    runBenchmark("requests/callback", n_requests, [&]() {
+        int remaining = n_requests;
+        for (int i = 0; i < n_requests; ++i) {
+            client.sendRequest(method, arg, [&](const QVariant&, const QString&) {
+                if (--remaining == 0) {
+                    loop.quit();
+                }
+            });
+        }
+        loop.exec();
+    });
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include "Benchmark.hpp"
+#include <QRpcPeer.hpp>
+#include <QRpcService.hpp>
+#include <QtCore/QCoreApplication>
+#include <QtCore/QEventLoop>
+#include <QtCore/QThread>
+#include <QtNetwork/QTcpServer>
+#include <QtNetwork/QTcpSocket>
+#include <memory>
+#include <string>
+#include <vector>
+
+
+class BenchObject : public QObject
+{
+    Q_OBJECT
+
+public slots:
+    int add(int a, int b) { return a + b; }
+};
+
+
+/**
+ * @brief ClientSet Peers connected to a service, sending requests from a separate client thread.
+ */
+struct ClientSet
+{
+    ClientSet(QTcpServer& server, QRpcService& service, int n_clients)
+    {
+        thread.start();
+        for (int i = 0; i < n_clients; ++i) {
+            auto* socket = new QTcpSocket;
+            socket->connectToHost(server.serverAddress(), server.serverPort());
+            socket->waitForConnected();
+            peers.push_back(new QRpcPeer(socket, socket));
+            socket->moveToThread(&thread);
+            sockets.push_back(socket);
+        }
+        // Let the service accept all connections
+        while (service.numberOfPeers() < sockets.size()) {
+            QCoreApplication::processEvents(QEventLoop::AllEvents, 10);
+        }
+    }
+
+    ~ClientSet()
+    {
+        // Peers are deleted with their sockets once the client thread finishes
+        for (auto* socket: sockets) {
+            socket->deleteLater();
+        }
+        thread.quit();
+        thread.wait();
+    }
+
+    // Send requests from all clients concurrently, return once all were answered
+    void run(const QString& method, int n_requests)
+    {
+        QEventLoop loop;
+        QMetaObject::invokeMethod(peers.front(), [&]() {
+            auto remaining = std::make_shared<std::size_t>(peers.size() * static_cast<std::size_t>(n_requests));
+            for (auto* peer: peers) {
+                for (int i = 0; i < n_requests; ++i) {
+                    peer->sendRequest(method, QVariant::fromValue(QVariantList{i, 1}),
+                                      [&loop, remaining](const QVariant&, const QString&) {
+                        if (--*remaining == 0) {
+                            QMetaObject::invokeMethod(&loop, &QEventLoop::quit, Qt::QueuedConnection);
+                        }
+                    });
+                }
+            }
+        });
+        loop.exec();
+    }
+
+    QThread thread;
+    std::vector<QTcpSocket*> sockets;
+    std::vector<QRpcPeer*> peers;
+};
+
+
+int main(int argc, char** argv)
+{
+    QCoreApplication app(argc, argv);
+    BenchObject obj;
+    constexpr int n_clients = 8;
+    constexpr int n_requests = 100;
+
+    for (int n_workers: {0, 1, 2, 4}) {
+        QTcpServer server;
+        server.listen(QHostAddress::LocalHost);
+        QRpcService service(&server);
+        service.setWorkerThreads(n_workers);
+        service.registerObject("obj", &obj);
+        service.registerHandler("typed.add", [](int a, int b) { return a + b; });
+        ClientSet clients(server, service, n_clients);
+
+        // Object methods, requests of all worker threads are dispatched by the service thread
+        const auto objectName = "workers/object_method/" + std::to_string(n_workers);
+        runBenchmark(objectName.c_str(), n_clients * n_requests, [&]() {
+            clients.run(QStringLiteral("obj.add"), n_requests);
+        });
+
+        // Typed handlers, answered by the thread serving the peer
+        const auto handlerName = "workers/typed_handler/" + std::to_string(n_workers);
+        runBenchmark(handlerName.c_str(), n_clients * n_requests, [&]() {
+            clients.run(QStringLiteral("typed.add"), n_requests);
+        });
+    }
+    return 0;
+}
+
+#include "bench_workers.moc"
@@ -1,16 +1,46 @@
 #include <QtTest/QtTest>
 #include <QRpcPeer.hpp>
 #include <QRpcService.hpp>
+#include <QRpcTracer.hpp>
+#include <QtMsgpackAdaptor.hpp>
+#include "RingBuffer.hpp"
 
 
 class RpcObject : public QObject
 {
     Q_OBJECT
+    Q_CLASSINFO("QRpcMethodPolicy:calledInPool", "threadpool")
 
 public slots:
     int method1(int a, int b) { return a + b; }
     QString method2(const QString& s) { return s.toUpper(); }
     QRpcPromise method3() { return QRpcPromise::resolve(42).delay(10); }
+    int method4(int a1, int a2, int a3, int a4, int a5, int a6,
+                int a7, int a8, int a9, int a10, int a11, int a12)
+    {
+        return a1 + a2 + a3 + a4 + a5 + a6 + a7 + a8 + a9 + a10 + a11 + a12;
+    }
+    QRpcPromise sleep(int ms)
+    {
+        return QRpcPromise(QRpcPromise::resolve(true).delay(ms)).onCancel([this]() { sleepCanceled = true; });
+    }
+    qint64 remainingTime() { return QRpcRequestContext::current().deadline().remainingTime(); }
+    bool calledInObjectThread() { return QThread::currentThread() == thread(); }
+    bool calledInPool() { return QThread::currentThread() != thread(); }
+    QRpcStreamGenerator count(int n)
+    {
+        return QRpcStreamGenerator([this, i = 0, n]() mutable -> std::optional<QVariant> {
+            if (i >= n) {
+                return std::nullopt;
+            }
+            ++countGenerated;
+            return i++;
+        });
+    }
+
+public:
+    bool sleepCanceled = false;
+    int countGenerated = 0;
 
 signals:
     void signal1(int value);
@@ -34,6 +64,17 @@ private slots:
         server.listen();
         service = new QRpcService(&server, this);
         service->registerObject("obj", &rpcObj);
+        service->registerHandler("typed.add", [](int a, double b) { return a + b; });
+        service->registerHandler("typed.concat", [](const QString& a, const std::string& b) {
+            return a + QString::fromStdString(b);
+        });
+        service->registerHandler("typed.scale", [](const QList<double>& values, double factor) {
+            QList<double> result;
+            for (const double value: values) {
+                result.append(value * factor);
+            }
+            return result;
+        });
     }
 
     void testRpcRequests()
@@ -67,6 +108,105 @@ private slots:
             }).wait();
             QVERIFY(result == 42);
         }
+        {
+            // Call `method4` with more than 10 arguments
+            int result = 0;
+            peer->sendRequest("obj.method4", {1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12}).then([&](const QVariant& r) {
+                result = r.toInt();
+            }).wait();
+            QVERIFY(result == 78);
+        }
+        {
+            // Unknown methods should be rejected
+            auto p = peer->sendRequest("obj.unknown");
+            p.wait();
+            QVERIFY(p.isRejected());
+        }
+        {
+            // Call typed handlers
+            double sum = 0;
+            peer->sendRequest("typed.add", {1, 2.5}).then([&](const QVariant& r) {
+                sum = r.toDouble();
+            }).wait();
+            QVERIFY(sum == 3.5);
+            QString concat;
+            peer->sendRequest("typed.concat", {"a", "b"}).then([&](const QVariant& r) {
+                concat = r.toString();
+            }).wait();
+            QVERIFY(concat == "ab");
+            auto p = peer->sendRequest("typed.add", "no number");
+            p.wait();
+            QVERIFY(p.isRejected());
+        }
+        {
+            // Send batch of requests, the response implies the remote features arrived
+            peer->announceFeatures();
+            QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+            auto promises = peer->sendRequests({{"typed.add", QVariantList{1, 2.5}}, {"obj.unknown", {}},
+                                                {"obj.method2", "batch"}});
+            QVERIFY(promises.size() == 3);
+            for (auto& p: promises) {
+                p.wait();
+            }
+            QVERIFY(promises[0].isFulfilled());
+            QVERIFY(promises[1].isRejected());
+            QString result;
+            promises[2].then([&](const QVariant& r) {
+                result = r.toString();
+            }).wait();
+            QVERIFY(result == "BATCH");
+            const auto map = QRpcRequestMap(*peer, "obj").add("method3").add("calledInObjectThread").wait();
+            QVERIFY(map.value("method3") == 42);
+            QVERIFY(map.value("calledInObjectThread") == true);
+            const auto eagerMap = QRpcRequestMap(*peer, "obj", false).add("method3").add("calledInObjectThread").wait();
+            QVERIFY(eagerMap == map);
+            // Requests of a map are sent once control returns to the event loop, also without calling all()
+            QRpcRequestMap pendingMap(*peer, "obj");
+            QVariant value;
+            pendingMap.add("method3", [&](const QVariant& v) { value = v; return v; });
+            QTRY_VERIFY(value == 42);
+        }
+        {
+            // Slow requests should not hold back the replies of faster requests in a batch
+            auto promises = peer->sendRequests({{"obj.sleep", 500}, {"obj.method1", QVariantList{1, 2}}});
+            promises[1].wait();
+            QVERIFY(promises[1].isFulfilled());
+            QVERIFY(promises[0].isPending());
+            promises[0].wait();
+            QVERIFY(promises[0].isFulfilled());
+        }
+        {
+            // Requests should time out if the response takes too long
+            auto p = peer->sendRequest("obj.sleep", 200, std::chrono::milliseconds(50));
+            p.wait();
+            QVERIFY(p.isRejected());
+            // Deadline should be available to the method
+            qint64 remaining = -1;
+            peer->sendRequest("obj.remainingTime", {}, std::chrono::milliseconds(5000)).then([&](const QVariant& r) {
+                remaining = r.toLongLong();
+            }).wait();
+            QVERIFY(remaining > 0 && remaining <= 5000);
+        }
+        {
+            // Canceling a request should reject it and cancel the promise returned by the method
+            auto p = peer->sendRequest("obj.sleep", 1000);
+            p.cancel();
+            p.wait();
+            QVERIFY(p.isRejected());
+            QTRY_VERIFY(rpcObj.sleepCanceled);
+        }
+        {
+            // Copies and chained promises should keep canceling the request
+            rpcObj.sleepCanceled = false;
+            auto p = peer->sendRequest("obj.sleep", 1000);
+            QRpcPromise copy;
+            copy = p;
+            const QRpcPromise chained = copy.tap([](const QVariant&) { }).timeout(5000);
+            chained.cancel();
+            p.wait();
+            QVERIFY(p.isRejected());
+            QTRY_VERIFY(rpcObj.sleepCanceled);
+        }
         {
             // RPC promise should reject on peer destruction
             auto p = peer->sendRequest("fail");
@@ -102,6 +242,929 @@ private slots:
             QVERIFY(result.at(1) == "Hello World");
         }
     }
+
+    void testRpcDuplicateRegistration()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+
+        // Registering an object under a second name should be ignored
+        RpcObject other;
+        service->registerObject("alias", &rpcObj);
+        service->registerObject("obj", &other);
+        QVERIFY(peer->sendRequest("alias.method1", {1, 2}).wait().isRejected());
+
+        // Unregistering the ignored name should keep the original registration
+        service->unregisterObject("alias");
+        QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+        QSignalSpy spy(peer.get(), &QRpcPeer::newEvent);
+        emit rpcObj.signal1(42);
+        QVERIFY(spy.wait());
+        QVERIFY(spy.takeFirst().at(0) == "obj.signal1");
+    }
+
+    void testRpcSubscriptions()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        QTRY_VERIFY(service->numberOfPeers() == 1);
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+
+        // Subscribe to `signal2` only, wait for a request to make sure the subscription arrived
+        peer->subscribe({"obj.*2"});
+        peer->sendRequest("obj.method1", {1, 2}).wait();
+
+        QSignalSpy spy(peer.get(), &QRpcPeer::newEvent);
+        emit rpcObj.signal1(42);
+        emit rpcObj.signal2(42, "Hello World");
+        QVERIFY(spy.wait());
+        QVERIFY(spy.takeFirst().at(0) == "obj.signal2");
+    }
+
+    void testRpcEventPolicies()
+    {
+        RpcObject policyObj;
+        service->registerObject("policy", &policyObj, {
+            {"signal1", QRpcEventPolicy::latest(50)},
+            {"signal2", QRpcEventPolicy::batch(50)},
+        });
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        QTRY_VERIFY(service->numberOfPeers() == 1);
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        peer->subscribe({"policy.*"});
+        peer->sendRequest("obj.method1", {1, 2}).wait();
+        // Peer receiving batches as single messages, the other one receives each emission separately
+        QTcpSocket batchSocket;
+        batchSocket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(batchSocket.waitForConnected());
+        auto batchPeer = std::make_unique<QRpcPeer>(&batchSocket);
+        batchPeer->announceFeatures();
+        batchPeer->subscribe({"policy.signal2"});
+        batchPeer->sendRequest("obj.method1", {1, 2}).wait();
+
+        QSignalSpy spy(peer.get(), &QRpcPeer::newEvent);
+        QSignalSpy batchSpy(batchPeer.get(), &QRpcPeer::newEvent);
+        {
+            // First and latest emission of `signal1` should arrive
+            for (int i = 1; i <= 10; ++i) {
+                emit policyObj.signal1(i);
+            }
+            QTRY_VERIFY(spy.count() == 2);
+            QTest::qWait(100);
+            QVERIFY(spy.count() == 2);
+            QVERIFY(spy.at(0).at(1).toList().at(0) == 1);
+            QVERIFY(spy.at(1).at(1).toList().at(0) == 10);
+            spy.clear();
+        }
+        {
+            // Batched emissions of `signal2` should arrive in order
+            for (int i = 1; i <= 3; ++i) {
+                emit policyObj.signal2(i, "batch");
+            }
+            QTRY_VERIFY(spy.count() == 3);
+            QTRY_VERIFY(batchSpy.count() == 3);
+            for (int i = 0; i < 3; ++i) {
+                QVERIFY(spy.at(i).at(0) == "policy.signal2");
+                QVERIFY(spy.at(i).at(1).toList().at(0) == i + 1);
+                QVERIFY(batchSpy.at(i).at(0) == "policy.signal2");
+                QVERIFY(batchSpy.at(i).at(1).toList().at(0) == i + 1);
+            }
+        }
+    }
+
+    void testRpcFeatureNegotiation()
+    {
+        const std::string longName = "negotiation.method.with.a.rather.long.name";
+        service->registerHandler(QString::fromStdString(longName), [](int a) { return a; });
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        {
+            // Peers not announcing features should only receive plain messages
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            msgpack::sbuffer request;
+            msgpack::packer<msgpack::sbuffer> packer(request);
+            packer.pack_array(4);
+            packer.pack(1);
+            packer.pack(longName);
+            packer.pack(std::vector<int>{42});
+            packer.pack(7);
+            socket.write(request.data(), static_cast<qint64>(request.size()));
+            QTRY_VERIFY(socket.bytesAvailable() > 0);
+            QTest::qWait(50);
+            const QByteArray data = socket.readAll();
+            std::size_t offset = 0;
+            const auto handle = msgpack::unpack(data.constData(), static_cast<std::size_t>(data.size()), offset);
+            const auto response = handle.get().as<std::vector<msgpack::object>>();
+            QVERIFY(offset == static_cast<std::size_t>(data.size()));
+            QVERIFY(response.size() == 3);
+            QVERIFY(response.at(0).as<int>() == 2);
+            QVERIFY(response.at(1).as<int>() == 7);
+            QVERIFY(response.at(2).as<int>() == 42);
+        }
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        {
+            // Peers announcing features should refer to interned names by id after defining them
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            auto peer = std::make_unique<QRpcPeer>(&socket);
+            peer->announceFeatures();
+            QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+            std::vector<quint64> sizes;
+            for (int i = 0; i < 3; ++i) {
+                const auto n_before = peer->metrics().bytesSent;
+                QVERIFY(peer->sendRequest(QString::fromStdString(longName), {i}).wait().isFulfilled());
+                sizes.push_back(peer->metrics().bytesSent - n_before);
+            }
+            QVERIFY(sizes.at(1) == sizes.at(2));
+            QVERIFY(sizes.at(0) > sizes.at(1) + longName.size());
+        }
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        {
+            // Defining more names than the limit should close the connection
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            msgpack::sbuffer names;
+            msgpack::packer<msgpack::sbuffer> packer(names);
+            for (int i = 0; i <= 4096; ++i) {
+                packer.pack_array(3);
+                packer.pack(9);
+                packer.pack(i);
+                packer.pack("name" + std::to_string(i));
+            }
+            socket.write(names.data(), static_cast<qint64>(names.size()));
+            QTRY_VERIFY(socket.state() == QAbstractSocket::UnconnectedState);
+        }
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        service->unregisterHandler(QString::fromStdString(longName));
+    }
+
+    void testRpcThreadAffinity()
+    {
+        QThread objectThread;
+        auto* threadedObj = new RpcObject;
+        threadedObj->moveToThread(&objectThread);
+        objectThread.start();
+        service->registerObject("threaded", threadedObj);
+
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        {
+            // Methods should be invoked in the thread of the object
+            bool result = false;
+            peer->sendRequest("threaded.calledInObjectThread").then([&](const QVariant& r) {
+                result = r.toBool();
+            }).wait();
+            QVERIFY(result);
+        }
+        {
+            // Methods with thread pool policy should be invoked in the thread pool
+            bool result = false;
+            peer->sendRequest("obj.calledInPool").then([&](const QVariant& r) {
+                result = r.toBool();
+            }).wait();
+            QVERIFY(result);
+        }
+        service->unregisterObject("threaded");
+        threadedObj->deleteLater();
+        objectThread.quit();
+        objectThread.wait();
+    }
+
+    void testRpcObjectLifetime()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+
+        // Calls queued to an object destroyed before processing them should be rejected
+        QThread idleThread;
+        auto* idleObj = new RpcObject;
+        idleObj->moveToThread(&idleThread);
+        service->registerObject("idle", idleObj);
+        auto p = peer->sendRequest("idle.method1", {1, 2});
+        QTest::qWait(100);
+        QVERIFY(!p.isFulfilled() && !p.isRejected());
+        delete idleObj;
+        QString error;
+        p.fail([&](const std::exception& e) {
+            error = e.what();
+            return QVariant();
+        }).wait();
+        QVERIFY(error == "RPC object destroyed");
+        QVERIFY(peer->sendRequest("idle.method1", {1, 2}).wait().isRejected());
+    }
+
+    void testRpcWorkerThreads()
+    {
+        QTcpServer workerServer;
+        workerServer.listen();
+        QRpcService workerService(&workerServer);
+        workerService.setWorkerThreads(2);
+        workerService.registerObject("obj", &rpcObj);
+        workerService.registerHandler("typed.add", [](int a, double b) { return a + b; });
+
+        constexpr int n_peers = 4;
+        std::vector<std::unique_ptr<QTcpSocket>> sockets;
+        std::vector<std::unique_ptr<QRpcPeer>> peers;
+        for (int i = 0; i < n_peers; ++i) {
+            sockets.push_back(std::make_unique<QTcpSocket>());
+            sockets.back()->connectToHost(workerServer.serverAddress(), workerServer.serverPort());
+            QVERIFY(sockets.back()->waitForConnected());
+            peers.push_back(std::make_unique<QRpcPeer>(sockets.back().get()));
+        }
+        QTRY_VERIFY(workerService.numberOfPeers() == n_peers);
+
+        // Requests to objects and typed handlers from peers served by different threads
+        for (auto& peer: peers) {
+            int result = 0;
+            peer->sendRequest("obj.method1", {1, 2}).then([&](const QVariant& r) {
+                result = r.toInt();
+            }).wait();
+            QVERIFY(result == 3);
+            double sum = 0;
+            peer->sendRequest("typed.add", {1, 2.5}).then([&](const QVariant& r) {
+                sum = r.toDouble();
+            }).wait();
+            QVERIFY(sum == 3.5);
+        }
+
+        // Events should reach the peers of all threads
+        std::vector<std::unique_ptr<QSignalSpy>> spies;
+        for (auto& peer: peers) {
+            spies.push_back(std::make_unique<QSignalSpy>(peer.get(), &QRpcPeer::newEvent));
+        }
+        emit rpcObj.signal1(42);
+        for (auto& spy: spies) {
+            QTRY_VERIFY(spy->count() == 1);
+            QVERIFY(spy->at(0).at(1).toList().at(0) == 42);
+        }
+        workerService.unregisterObject("obj");
+    }
+
+    void testRpcConcurrencyLimits()
+    {
+        // Restore unlimited processing even if a check fails
+        const auto restoreLimits = qScopeGuard([this]() {
+            service->setConcurrencyLimits(0, 0);
+            service->setPauseReadsWhenOverloaded(false);
+        });
+        service->setConcurrencyLimits(1, 1);
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+
+        // One request should be processed, one queued and one rejected
+        auto promises = peer->sendRequests({{"obj.sleep", 100}, {"obj.sleep", 10}, {"obj.sleep", 10}});
+        for (auto& p: promises) {
+            p.wait();
+        }
+        QVERIFY(promises[0].isFulfilled());
+        QVERIFY(promises[1].isFulfilled());
+        QVERIFY(promises[2].isRejected());
+        QString error;
+        promises[2].fail([&](const std::exception& e) {
+            error = e.what();
+            return QVariant();
+        }).wait();
+        QVERIFY(error == "Server overloaded");
+
+        // Typed handlers should be queued and rejected like other requests
+        auto typed = peer->sendRequests({{"obj.sleep", 100}, {"typed.add", QVariantList{1, 2.5}},
+                                         {"typed.add", QVariantList{2, 2.5}}});
+        for (auto& p: typed) {
+            p.wait();
+        }
+        QVariant sum;
+        typed[1].then([&](const QVariant& r) {
+            sum = r;
+        }).wait();
+        QVERIFY(sum == 3.5);
+        QVERIFY(typed[2].isRejected());
+
+        // Queued requests should be processed once previous requests finished
+        auto p1 = peer->sendRequest("obj.sleep", 50);
+        auto p2 = peer->sendRequest("obj.sleep", 10);
+        p2.wait();
+        QVERIFY(p1.isFulfilled());
+
+        // Peers waiting for a shared limit should continue as soon as another peer releases it
+        peer.reset();
+        socket.abort();
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        service->setConcurrencyLimits(0, 10, 1);
+        service->setPauseReadsWhenOverloaded(true);
+        QTcpSocket otherSocket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        otherSocket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected() && otherSocket.waitForConnected());
+        peer = std::make_unique<QRpcPeer>(&socket);
+        auto otherPeer = std::make_unique<QRpcPeer>(&otherSocket);
+        QTRY_VERIFY(service->numberOfPeers() == 2);
+        auto slow = peer->sendRequest("obj.sleep", 100);
+        QTRY_VERIFY(service->metrics().requestsInFlight == 1);
+        // Requests sent after pausing stay unread but are processed in order once resumed
+        std::vector<QRpcPromise> waiting;
+        for (int i = 0; i < 3; ++i) {
+            waiting.push_back(otherPeer->sendRequest("obj.method1", {i, 1}));
+        }
+        QTRY_VERIFY(waiting.back().isFulfilled());
+        for (int i = 0; i < 3; ++i) {
+            int result = 0;
+            waiting[i].then([&](const QVariant& r) {
+                result = r.toInt();
+            }).wait();
+            QVERIFY(result == i + 1);
+        }
+        QVERIFY(slow.isFulfilled());
+    }
+
+    void testRpcStreams()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        {
+            // Items should arrive in order, never exceeding the granted credit
+            constexpr int credits = 10;
+            auto reader = peer->sendStreamRequest("obj.count", 1000, credits);
+            QVariantList items;
+            qsizetype maxAvailable = 0;
+            connect(reader.get(), &QRpcStreamReader::readyRead, this, [&]() {
+                maxAvailable = std::max(maxAvailable, reader->itemsAvailable());
+                items.append(reader->read());
+            });
+            QTRY_VERIFY(reader->isFinished());
+            QVERIFY(reader->result().isFulfilled());
+            QVERIFY(items.size() == 1000);
+            QVERIFY(items.first() == 0 && items.last() == 999);
+            QVERIFY(maxAvailable <= credits);
+        }
+        {
+            // Requests without stream should receive all items at once
+            QVariantList items;
+            peer->sendRequest("obj.count", 5).then([&](const QVariant& r) {
+                items = r.toList();
+            }).wait();
+            QVERIFY(items == (QVariantList{0, 1, 2, 3, 4}));
+        }
+        {
+            // Requests without stream should be rejected if there are too many items
+            auto p = peer->sendRequest("obj.count", 1000000);
+            p.wait();
+            QVERIFY(p.isRejected());
+        }
+        {
+            // Streams should count against the concurrency limit until they ended
+            const auto restoreLimits = qScopeGuard([this]() {
+                service->setConcurrencyLimits(0, 0);
+            });
+            service->setConcurrencyLimits(1, 0);
+            auto reader = peer->sendStreamRequest("obj.count", 1000000, 1);
+            QTRY_VERIFY(reader->itemsAvailable() == 1);
+            QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isRejected());
+
+            // Destroying the reader should cancel the stream, stop pulling items and release its slot
+            rpcObj.countGenerated = 0;
+            reader->read();
+            QTRY_VERIFY(rpcObj.countGenerated == 1);
+            reader.reset();
+            QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+            QTest::qWait(50);
+            QVERIFY(rpcObj.countGenerated == 1);
+        }
+    }
+
+    void testRpcMetrics()
+    {
+        service->setStatsMethodEnabled(true);
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        for (int i = 0; i < 3; ++i) {
+            QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+        }
+        QVERIFY(peer->sendRequest("obj.unknown").wait().isRejected());
+
+        // Service should count calls and errors per method
+        QVariantMap stats;
+        peer->sendRequest("rpc.stats").then([&](const QVariant& r) {
+            stats = r.toMap();
+        }).wait();
+        QVERIFY(stats.value("peers").toInt() == 1);
+        const auto methods = stats.value("total").toMap().value("methods").toMap();
+        const auto method1 = methods.value("obj.method1").toMap();
+        QVERIFY(method1.value("calls").toInt() == 3);
+        QVERIFY(method1.value("errors").toInt() == 0);
+        QVERIFY(method1.value("latency_us").toMap().value("count").toInt() == 3);
+        QVERIFY(methods.value("obj.unknown").toMap().value("errors").toInt() == 1);
+
+        // Client should count requests and bytes
+        const auto metrics = peer->metrics();
+        QVERIFY(metrics.requestsSent == 5);
+        QVERIFY(metrics.bytesSent > 0 && metrics.bytesReceived > 0);
+        QVERIFY(metrics.pendingResponses == 0);
+        service->setStatsMethodEnabled(false);
+    }
+
+    void testRpcCompression()
+    {
+        service->setCompressionThreshold(256);
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        peer->announceFeatures();
+        peer->setCompressionThreshold(256);
+
+        // Small messages are not compressed, the response implies the remote features arrived
+        QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+        QVERIFY(peer->compressionStats().compressedMessages == 0);
+
+        // Large messages should be compressed in both directions, including the first use of an interned name
+        QString result;
+        peer->sendRequest("obj.method2", QString(10000, 'a')).timeout(5000).then([&](const QVariant& r) {
+            result = r.toString();
+        }).wait();
+        QVERIFY(result == QString(10000, 'A'));
+        const auto stats = peer->compressionStats();
+        QVERIFY(stats.compressedMessages == 1);
+        QVERIFY(stats.bytesSaved() > 9000);
+        service->setCompressionThreshold(0);
+
+        // Server peers should count compressed responses and events, encoded events are shared by all peers
+        QTcpServer pairServer;
+        pairServer.listen();
+        std::vector<std::unique_ptr<QTcpSocket>> clientSockets;
+        std::vector<std::unique_ptr<QRpcPeer>> clients;
+        std::vector<std::unique_ptr<QRpcPeer>> servers;
+        for (int i = 0; i < 2; ++i) {
+            clientSockets.push_back(std::make_unique<QTcpSocket>());
+            clientSockets.back()->connectToHost(pairServer.serverAddress(), pairServer.serverPort());
+            QVERIFY(clientSockets.back()->waitForConnected());
+            QVERIFY(pairServer.waitForNewConnection(1000));
+            servers.push_back(std::make_unique<QRpcPeer>(pairServer.nextPendingConnection()));
+            servers.back()->setCompressionThreshold(256);
+            connect(servers.back().get(), &QRpcPeer::newRequest, this,
+                    [](const QString&, const QVariant& args, const QRpcPromise::Resolve& resolve,
+                       const QRpcPromise::Reject&, const QRpcRequestContext&) {
+                resolve(args);
+            });
+            clients.push_back(std::make_unique<QRpcPeer>(clientSockets.back().get()));
+            clients.back()->announceFeatures();
+        }
+        for (int i = 0; i < 2; ++i) {
+            QVariant echo;
+            clients[i]->sendRequest("echo", QString(10000, 'b')).then([&](const QVariant& r) {
+                echo = r;
+            }).wait();
+            QVERIFY(echo == QString(10000, 'b'));
+            QVERIFY(servers[i]->compressionStats().compressedMessages == 1);
+        }
+        QSignalSpy spy0(clients[0].get(), &QRpcPeer::newEvent);
+        QSignalSpy spy1(clients[1].get(), &QRpcPeer::newEvent);
+        const QRpcEncodedEvent event("large", QString(10000, 'c'));
+        for (auto& server: servers) {
+            server->sendEvent(event);
+        }
+        QTRY_VERIFY(spy0.count() == 1 && spy1.count() == 1);
+        QVERIFY(spy0.at(0).at(1) == QString(10000, 'c'));
+        QVERIFY(spy1.at(0).at(1) == QString(10000, 'c'));
+        const auto stats0 = servers[0]->compressionStats();
+        const auto stats1 = servers[1]->compressionStats();
+        QVERIFY(stats0.compressedMessages == 2 && stats1.compressedMessages == 2);
+        QVERIFY(stats0.compressedBytes == stats1.compressedBytes);
+        QVERIFY(stats0.bytesSaved() > 2 * 9000);
+
+        // A large first event defines its interned name in front of the compressed message
+        QSignalSpy serverSpy(servers[0].get(), &QRpcPeer::newEvent);
+        clients[0]->setCompressionThreshold(256);
+        clients[0]->sendEvent("client.large", QString(10000, 'd'));
+        QTRY_VERIFY_WITH_TIMEOUT(serverSpy.count() == 1, 5000);
+        QVERIFY(serverSpy.at(0).at(0) == QString("client.large"));
+        QVERIFY(serverSpy.at(0).at(1) == QString(10000, 'd'));
+        QVERIFY(clients[0]->compressionStats().compressedMessages == 1);
+    }
+
+    void testRpcBlobs()
+    {
+        QTcpServer blobServer;
+        blobServer.listen();
+        QTcpSocket socket;
+        socket.connectToHost(blobServer.serverAddress(), blobServer.serverPort());
+        QVERIFY(socket.waitForConnected());
+        QVERIFY(blobServer.waitForNewConnection(1000));
+        QTcpSocket* serverSocket = blobServer.nextPendingConnection();
+        QRpcPeer sender(&socket);
+        QRpcPeer receiver(serverSocket);
+
+        // Received chunks should be written to the sink
+        QBuffer sink;
+        sink.open(QIODevice::WriteOnly);
+        QString sinkName;
+        receiver.setBlobSinkFactory([&](const QString& name, qint64 size) -> QIODevice* {
+            sinkName = name;
+            sink.buffer().reserve(size);
+            return &sink;
+        });
+        QSignalSpy spy(&receiver, &QRpcPeer::blobReceived);
+
+        QTemporaryFile file;
+        QVERIFY(file.open());
+        QByteArray data(3 * 1024 * 1024 + 123, '\0');
+        for (qsizetype i = 0; i < data.size(); ++i) {
+            data[i] = static_cast<char>(i % 251);
+        }
+        file.write(data);
+        file.flush();
+        auto p = sender.sendFile(&file, "data.bin");
+        p.wait();
+        QVERIFY(p.isFulfilled());
+        QTRY_VERIFY(spy.count() == 1);
+        QVERIFY(spy.at(0).at(0).toString() == "data.bin");
+        QVERIFY(spy.at(0).at(2).toString().isEmpty());
+        QVERIFY(sinkName == "data.bin");
+        QVERIFY(sink.data() == data);
+    }
+
+    void testRpcZeroCopy()
+    {
+        auto payload = [](int i) { return QByteArray(1000 + i, static_cast<char>('a' + i)); };
+        constexpr int n = 8;
+        {
+            // Binary arguments kept by handlers should stay valid after the request was answered
+            service->setZeroCopyDecoding(true);
+            QList<msgpack::QtSharedBytes> kept;
+            service->registerHandler("bytes.keep", [&](msgpack::QtSharedBytes data) {
+                kept.append(data);
+                return static_cast<int>(data.size());
+            });
+            QTRY_VERIFY(service->numberOfPeers() == 0);
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            auto peer = std::make_unique<QRpcPeer>(&socket);
+            for (int i = 0; i < n; ++i) {
+                QVERIFY(peer->sendRequest("bytes.keep", QVariantList{payload(i)}).wait().isFulfilled());
+            }
+            peer.reset();
+            socket.disconnectFromHost();
+            QTRY_VERIFY(service->numberOfPeers() == 0);
+            QVERIFY(kept.size() == n);
+            for (int i = 0; i < n; ++i) {
+                QVERIFY(kept.at(i).view() == payload(i));
+            }
+            service->unregisterHandler("bytes.keep");
+            service->setZeroCopyDecoding(false);
+        }
+        {
+            // Events delivered to queued receivers should stay valid after the emission returned
+            QTcpServer eventServer;
+            eventServer.listen();
+            QTcpSocket socket;
+            socket.connectToHost(eventServer.serverAddress(), eventServer.serverPort());
+            QVERIFY(socket.waitForConnected());
+            QVERIFY(eventServer.waitForNewConnection(1000));
+            QRpcPeer sender(&socket);
+            QRpcPeer receiver(eventServer.nextPendingConnection());
+            receiver.setZeroCopyDecoding(true);
+            QVariantList events;
+            connect(&receiver, &QRpcPeer::newEvent, this, [&](const QString&, const QVariant& data) {
+                events.append(data);
+            }, Qt::QueuedConnection);
+            for (int i = 0; i < n; ++i) {
+                sender.sendEvent("bytes", payload(i));
+            }
+            QTRY_VERIFY(events.size() == n);
+            for (int i = 0; i < n; ++i) {
+                QVERIFY(events.at(i).value<msgpack::QtSharedBytes>().view() == payload(i));
+                QVERIFY(events.at(i).toByteArray() == payload(i));
+            }
+        }
+        {
+            // The message should only be retained once large binary data references it
+            const auto message = std::make_shared<int>(0);
+            int n_retained = 0;
+            msgpack::QtZeroCopyScope zeroCopy([&]() -> std::shared_ptr<const void> {
+                ++n_retained;
+                return message;
+            }, 1024);
+            msgpack::sbuffer small;
+            msgpack::pack(small, QVariantList{1, QByteArray(100, 'x')});
+            const auto smallHandle = msgpack::unpack(small.data(), small.size());
+            const auto smallValue = smallHandle->as<QVariant>().toList().at(1);
+            QVERIFY(smallValue.value<msgpack::QtSharedBytes>().view() == QByteArray(100, 'x'));
+            QVERIFY(n_retained == 0 && message.use_count() == 1);
+            msgpack::sbuffer large;
+            msgpack::pack(large, QVariantList{QByteArray(2000, 'y'), QByteArray(2000, 'z')});
+            const auto largeHandle = msgpack::unpack(large.data(), large.size());
+            const auto largeValue = largeHandle->as<QVariant>().toList();
+            QVERIFY(largeValue.at(1).value<msgpack::QtSharedBytes>().view() == QByteArray(2000, 'z'));
+            QVERIFY(n_retained == 1 && message.use_count() == 4);
+        }
+    }
+
+    void testRpcWriteBuffer()
+    {
+        // Ring buffer should keep the order of data across wraparound and growth
+        RingBuffer ring(16);
+        QByteArray out;
+        auto drain = [&](std::size_t n) {
+            while (n > 0 && !ring.isEmpty()) {
+                const std::size_t n_read = std::min(n, ring.readSize());
+                out.append(ring.readPointer(), static_cast<qsizetype>(n_read));
+                ring.consume(n_read);
+                n -= n_read;
+            }
+        };
+        ring.append("0123456789", 10);
+        drain(8);
+        ring.append("abcdefghij", 10);
+        QVERIFY(ring.capacity() == 16);
+        QVERIFY(ring.size() == 12);
+        QVERIFY(ring.readSize() == 8);
+        const QByteArray large(40, 'x');
+        ring.append(large.constData(), static_cast<std::size_t>(large.size()));
+        QVERIFY(ring.capacity() == 64);
+        drain(ring.size());
+        QVERIFY(out == "0123456789abcdefghij" + large);
+        ring.shrink();
+        QVERIFY(ring.capacity() == 16);
+
+        QTcpServer bufferServer;
+        bufferServer.listen();
+        QTcpSocket socket;
+        socket.connectToHost(bufferServer.serverAddress(), bufferServer.serverPort());
+        QVERIFY(socket.waitForConnected());
+        QVERIFY(bufferServer.waitForNewConnection(1000));
+        QRpcPeer sender(&socket);
+        QRpcPeer receiver(bufferServer.nextPendingConnection());
+        sender.setWriteBufferWatermarks(1024, 64 * 1024);
+        QSignalSpy fullSpy(&sender, &QRpcPeer::writeBufferFull);
+        QSignalSpy drainedSpy(&sender, &QRpcPeer::writeBufferDrained);
+        QSignalSpy eventSpy(&receiver, &QRpcPeer::newEvent);
+        const QByteArray payload(1024 * 1024, 'a');
+
+        // Exceeding the high watermark should be signaled once until the buffer drained
+        sender.sendEvent("buffer", payload);
+        QVERIFY(fullSpy.count() == 1);
+        QVERIFY(sender.isWriteBufferFull());
+        QTRY_VERIFY(drainedSpy.count() == 1);
+        QVERIFY(!sender.isWriteBufferFull());
+        QTRY_VERIFY(eventSpy.count() == 1);
+
+        // Blocking should not wait for the device, reads resume once the buffer drained
+        sender.setSlowConsumerPolicy(QRpcPeer::SlowConsumerPolicy::Block);
+        QSignalSpy senderEventSpy(&sender, &QRpcPeer::newEvent);
+        sender.sendEvent("block", payload);
+        QVERIFY(sender.isWriteBufferFull());
+        receiver.sendEvent("ping");
+        QTRY_VERIFY(drainedSpy.count() == 2);
+        QTRY_VERIFY(senderEventSpy.count() == 1);
+        QTRY_VERIFY(eventSpy.count() == 2);
+
+        // Events should be dropped while the buffer is full
+        sender.setSlowConsumerPolicy(QRpcPeer::SlowConsumerPolicy::DropEvents);
+        sender.sendEvent("drop", payload);
+        sender.sendEvent("dropped");
+        QTRY_VERIFY(drainedSpy.count() == 3);
+        sender.sendEvent("sync");
+        QTRY_VERIFY(eventSpy.count() == 4);
+        QVERIFY(eventSpy.at(2).at(0) == "drop");
+        QVERIFY(eventSpy.at(3).at(0) == "sync");
+
+        // Slow consumers should be disconnected
+        sender.setSlowConsumerPolicy(QRpcPeer::SlowConsumerPolicy::Disconnect);
+        sender.sendEvent("disconnect", payload);
+        QVERIFY(socket.state() == QAbstractSocket::UnconnectedState);
+        QVERIFY(fullSpy.count() == 4);
+    }
+
+    void testRpcCallbacks()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+
+        // Callbacks of many requests in flight should be called with their result
+        const int n = 1000;
+        int n_finished = 0;
+        int n_errors = 0;
+        int sum = 0;
+        for (int i = 0; i < n; ++i) {
+            peer->sendRequest("obj.method1", QVariantList{i, 1}, [&](const QVariant& r, const QString& error) {
+                // QVERIFY cannot abort the test from within the callback, check errors afterwards
+                n_errors += error.isEmpty() ? 0 : 1;
+                sum += r.toInt();
+                ++n_finished;
+            });
+        }
+        QTRY_VERIFY(n_finished == n);
+        QVERIFY(n_errors == 0);
+        QVERIFY(sum == n * (n + 1) / 2);
+        QVERIFY(peer->metrics().pendingResponses == 0);
+
+        // Errors should be reported to the callback
+        QString error;
+        peer->sendRequest("obj.unknown", {}, [&](const QVariant&, const QString& e) { error = e; });
+        QTRY_VERIFY(!error.isEmpty());
+    }
+
+    void testRpcReceiveLimits()
+    {
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        {
+            // Large lists should pass the default limits in both directions
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            auto peer = std::make_unique<QRpcPeer>(&socket);
+            QVariantList values;
+            for (int i = 0; i < 100000; ++i) {
+                values.append(double(i));
+            }
+            QVariantList result;
+            peer->sendRequest("typed.scale", QVariantList{values, 1.0}).timeout(5000).then([&](const QVariant& r) {
+                result = r.toList();
+            }).wait();
+            QVERIFY(result.size() == values.size());
+            QVERIFY(result.back() == values.back());
+        }
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        {
+            // Header of an array with 2^32-1 items should close the connection without allocating the array
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            QTRY_VERIFY(service->numberOfPeers() == 1);
+            socket.write(QByteArray::fromHex("ddffffffff"));
+            QTRY_VERIFY(socket.state() == QAbstractSocket::UnconnectedState);
+            QTRY_VERIFY(service->numberOfPeers() == 0);
+        }
+        {
+            // Messages exceeding the size limit should close the connection
+            service->setReceiveLimits({1024});
+            QTcpSocket socket;
+            socket.connectToHost(server.serverAddress(), server.serverPort());
+            QVERIFY(socket.waitForConnected());
+            auto peer = std::make_unique<QRpcPeer>(&socket);
+            QVERIFY(peer->sendRequest("obj.method2", "small").wait().isFulfilled());
+            peer->sendRequest("obj.method2", QString(4096, 'x'));
+            QTRY_VERIFY(socket.state() == QAbstractSocket::UnconnectedState);
+            service->setReceiveLimits({});
+        }
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+    }
+
+    void testRpcTypedArrays()
+    {
+        // Lists of numbers should be packed as ext objects if enabled and as arrays otherwise
+        const QList<float> values{1.5f, -2.0f, 3.25f};
+        msgpack::sbuffer plain;
+        msgpack::pack(plain, QVariant::fromValue(values));
+        const auto plainHandle = msgpack::unpack(plain.data(), plain.size());
+        QVERIFY(plainHandle.get().type == msgpack::type::ARRAY);
+        QVERIFY(plainHandle.get().as<QList<float>>() == values);
+        msgpack::sbuffer typed;
+        {
+            msgpack::QtTypedArrayScope typedArrays;
+            msgpack::pack(typed, QVariant::fromValue(values));
+        }
+        const auto typedHandle = msgpack::unpack(typed.data(), typed.size());
+        QVERIFY(typedHandle.get().type == msgpack::type::EXT);
+        QVERIFY(typed.size() < plain.size());
+        QVERIFY(typedHandle.get().as<QVariant>().value<QList<float>>() == values);
+
+        // Peers supporting packed arrays should exchange them
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        peer->announceFeatures();
+        QVariant result;
+        peer->sendRequest("typed.scale", {QVariant::fromValue(QList<double>{1, 2, 3}), 2.0}).then([&](const QVariant& r) {
+            result = r;
+        }).wait();
+        QVERIFY(result.metaType() == QMetaType::fromType<QList<double>>());
+        QVERIFY(result.value<QList<double>>() == (QList<double>{2, 4, 6}));
+    }
+
+    void testRpcTracer()
+    {
+        QTemporaryFile file;
+        QVERIFY(file.open());
+        {
+            QRpcChromeTracer tracer(file.fileName());
+            QVERIFY(tracer.isOpen());
+            tracer.trace({QRpcTracer::Stage::BytesRead, nullptr, 0, {}, 42});
+            tracer.trace({QRpcTracer::Stage::Decoded, nullptr, 1, u"add", 0});
+            tracer.trace({QRpcTracer::Stage::MethodInvoked, nullptr, 1, {}, 0});
+            tracer.trace({QRpcTracer::Stage::ResponsePacked, nullptr, 1, {}, 0});
+        }
+        QJsonParseError error;
+        const auto doc = QJsonDocument::fromJson(file.readAll(), &error);
+        QVERIFY(error.error == QJsonParseError::NoError);
+        const auto events = doc.array();
+        QVERIFY(events.size() == 4);
+        QVERIFY(events.at(0)["ph"] == "i");
+        QVERIFY(events.at(0)["args"]["bytes"] == 42);
+        QVERIFY(events.at(1)["ph"] == "b");
+        QVERIFY(events.at(2)["ph"] == "n");
+        QVERIFY(events.at(2)["name"] == "add");
+        QVERIFY(events.at(3)["ph"] == "e");
+        QVERIFY(events.at(3)["id"] == events.at(1)["id"]);
+    }
+
+    void testRpcTracedRequest()
+    {
+#ifndef QTRPC_ENABLE_TRACING
+        QSKIP("QtRpc built without QTRPC_ENABLE_TRACING");
+#else
+        // Record events reported from any thread
+        struct RecordingTracer : QRpcTracer
+        {
+            struct Record
+            {
+                Stage stage;
+                const QRpcPeer* peer;
+                std::uint64_t id;
+                QString method;
+            };
+
+            void trace(const Event& event) override
+            {
+                QMutexLocker lock(&mutex);
+                records.push_back({event.stage, event.peer, event.id, event.method.toString()});
+            }
+
+            QMutex mutex;
+            std::vector<Record> records;
+        } tracer;
+
+        QTRY_VERIFY(service->numberOfPeers() == 0);
+        QTcpSocket socket;
+        socket.connectToHost(server.serverAddress(), server.serverPort());
+        QVERIFY(socket.waitForConnected());
+        auto peer = std::make_unique<QRpcPeer>(&socket);
+        QTRY_VERIFY(service->numberOfPeers() == 1);
+        QRpcTracer::install(&tracer);
+        const auto uninstall = qScopeGuard([]() { QRpcTracer::install(nullptr); });
+        QVERIFY(peer->sendRequest("obj.method1", {1, 2}).wait().isFulfilled());
+        QRpcTracer::install(nullptr);
+
+        // The request should pass all stages in order at the serving peer
+        QMutexLocker lock(&tracer.mutex);
+        const auto& records = tracer.records;
+        const auto decoded = std::find_if(records.cbegin(), records.cend(), [](const auto& r) {
+            return r.stage == QRpcTracer::Stage::Decoded && r.method == "obj.method1";
+        });
+        QVERIFY(decoded != records.cend());
+        const QRpcPeer* servingPeer = decoded->peer;
+        QVERIFY(servingPeer != peer.get());
+        std::vector<QRpcTracer::Stage> stages;
+        for (const auto& r: records) {
+            if (r.peer == servingPeer && r.id == decoded->id) {
+                stages.push_back(r.stage);
+            }
+        }
+        QVERIFY(stages == (std::vector<QRpcTracer::Stage>{
+            QRpcTracer::Stage::Decoded, QRpcTracer::Stage::RequestEmitted, QRpcTracer::Stage::MethodInvoked,
+            QRpcTracer::Stage::Resolved, QRpcTracer::Stage::ResponsePacked}));
+        // Bytes of the request and the response should be reported by both peers
+        for (const QRpcPeer* p: {servingPeer, static_cast<const QRpcPeer*>(peer.get())}) {
+            for (const auto stage: {QRpcTracer::Stage::BytesRead, QRpcTracer::Stage::BytesFlushed}) {
+                QVERIFY(std::any_of(records.cbegin(), records.cend(), [&](const auto& r) {
+                    return r.peer == p && r.stage == stage;
+                }));
+            }
+        }
+#endif
+    }
 };
 
 QTEST_MAIN(TestRpc)